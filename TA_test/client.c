@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdlib.h>
@@ -8,29 +9,53 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
+#include <zlib.h>
 
 char gSc = 0;
 int recv_msg(int from);
 int readline(int fd,char *ptr,int maxlen);
 
+/* server output is a deflate stream after "setenv RAS_COMPRESS zlib" */
+int gServerFd = -1;
+int gZlib = 0;
+z_stream gZstream;
+unsigned char gZin[4096];
+char gZout[8192];
+int gZoutLen = 0, gZoutPos = 0;
+long gWireBytes = 0;
+int read_byte(int fd,char *c);
+int zlib_pending(void);
+
+/* after "setenv RAS_PROTOCOL framed" lines go as request frames, see protocol.h */
+int framed_session(int fd,int line_fd);
+int read_frames(int fd);
+int read_full(int fd,char *buf,int len);
+unsigned int get_u32(const char *buf);
+
 
 int main(int argc,char *argv[])
 {
 	fd_set readfds;
 	int    client_fd;
 	struct sockaddr_in client_sin;
+	struct sockaddr_un client_sun;
 	char msg_buf[30000];
 	int len;
 	int SERVER_PORT;
 	FILE *fp; 
 	int end;
+	int burst = 0;
 	struct hostent *he; 
+	struct timeval no_wait;
 	gSc = 0;
  if(argc == 3)
  	fp = stdin;
 
- else if(argc == 4)
+ else if(argc == 4 || (argc == 5 && !strcmp(argv[4],"burst")))
  {	
+ 	// burst: send the whole file at once, not a line per prompt
+ 	burst = (argc == 5);
  	fp = fopen(argv[3], "r");
  	if (fp == NULL) {
  		fprintf(stderr,"Error : '%s' doesn't exist\n", argv[3]);
@@ -39,10 +64,30 @@ int main(int argc,char *argv[])
  }
  else
  {
- 	fprintf(stderr,"Usage : client <server ip> <port> <testfile>\n");
+ 	fprintf(stderr,"Usage : client <server ip|/unix/socket/path> <port> <testfile> [burst]\n");
         exit(1);
  }    
 
+ if(argv[1][0] == '/')
+ {
+ 	// unix socket of ras --unix, port is ignored
+ 	if(strlen(argv[1]) >= sizeof(client_sun.sun_path))
+ 	{
+ 		fprintf(stderr,"Error : socket path too long\n");
+ 		exit(1);
+ 	}
+ 	client_fd = socket(AF_UNIX,SOCK_STREAM,0);
+ 	bzero(&client_sun,sizeof(client_sun));
+ 	client_sun.sun_family = AF_UNIX;
+ 	strcpy(client_sun.sun_path, argv[1]);
+ 	if(connect(client_fd,(struct sockaddr *)&client_sun,sizeof(client_sun)) == -1)
+ 	{
+ 		perror("");
+ 		exit(1);
+ 	}
+ }
+ else
+ {
  if((he=gethostbyname(argv[1])) == NULL)
  {
  	fprintf(stderr,"Usage : client <server ip> <port> <testfile>");
@@ -61,9 +106,23 @@ int main(int argc,char *argv[])
   perror("");
   exit(1);
  }
+ }
 
+ gServerFd = client_fd;
  sleep(1);     //waiting for welcome messages
  
+ if(burst)
+ {
+ 	// lines queue up in the server, then print replies until it closes
+ 	while((len = fread(msg_buf,1,sizeof(msg_buf),fp)) > 0)
+ 		if(write(client_fd,msg_buf,len) == -1) return -1;
+ 	fclose(fp);
+ 	while((len = recv_msg(client_fd)) > 0)
+ 	{}
+ 	close(client_fd);
+ 	exit(len < 0);
+ }
+
  end=0;
  while(1)
  { 
@@ -71,7 +130,9 @@ int main(int argc,char *argv[])
   FD_SET(client_fd,&readfds);
   if(end==0)
   	FD_SET(fileno(fp),&readfds);
-  if(select(client_fd+1,&readfds,NULL,NULL,NULL) < 0)
+  no_wait.tv_sec = 0;
+  no_wait.tv_usec = 0;
+  if(select(client_fd+1,&readfds,NULL,NULL,zlib_pending() ? &no_wait : NULL) < 0)
    exit(1);
   
 
@@ -89,6 +150,14 @@ int main(int argc,char *argv[])
   	fflush(stdout);
   	if(write(client_fd,msg_buf,len+1) == -1) return -1;
 
+	if(!gZlib && !strncmp(msg_buf,"setenv RAS_COMPRESS zlib",24))
+	{
+		/* everything after this line is compressed */
+		memset(&gZstream,0,sizeof(gZstream));
+		if(inflateInit(&gZstream) != Z_OK) exit(1);
+		gZlib = 1;
+	}
+
 	/*if(!strncmp(msg_buf,"exit",4))
 	{
 		sleep(2);	//waiting for server messages
@@ -101,8 +170,14 @@ int main(int argc,char *argv[])
 	}    */
 	//usleep(1000);// delay 1000 microsecond
 	gSc =0;
+
+	if(!strncmp(msg_buf,"setenv RAS_PROTOCOL framed",26))
+	{
+		/* back here after "setenv RAS_PROTOCOL text", the server sends a prompt */
+		if(framed_session(client_fd,fileno(fp)) < 0) exit(1);
+	}
   }
-  if(FD_ISSET(client_fd,&readfds))
+  if(FD_ISSET(client_fd,&readfds) || zlib_pending())
   {
 	  //message
 	  int errnum;
@@ -115,6 +190,7 @@ int main(int argc,char *argv[])
 	  } else if (errnum ==0){
 		  shutdown(client_fd,2);
 		  close(client_fd);
+		  fprintf(stderr,"received %ld bytes on wire\n",gWireBytes);
 		  exit(0);
 	  }
   }
@@ -140,7 +216,7 @@ int readline(int fd,char *ptr,int maxlen)
 	*ptr = 0;
 	for(n=1;n<maxlen;n++)
 	{
-		if((rc=read(fd,&c,1)) == 1)
+		if((rc=read_byte(fd,&c)) == 1)
 		{
 			*ptr++ = c;	
 			if(c==' '&& *(ptr-2) =='%'){ gSc = 1; break; }
@@ -155,5 +231,133 @@ int readline(int fd,char *ptr,int maxlen)
 			return(-1);
 	}
 	return(n);
-}      
-  
+}
+
+int read_byte(int fd,char *c)
+{
+	int n,ret;
+	if(fd != gServerFd) return read(fd,c,1);
+	while(gZoutPos == gZoutLen)
+	{
+		if(!gZlib)
+		{
+			if((n=read(fd,c,1)) == 1) gWireBytes++;
+			return n;
+		}
+		if(gZstream.avail_in == 0)
+		{
+			if((n=read(fd,gZin,sizeof(gZin))) <= 0) return n;
+			gWireBytes += n;
+			gZstream.next_in = gZin;
+			gZstream.avail_in = n;
+		}
+		gZstream.next_out = (Bytef *)gZout;
+		gZstream.avail_out = 4096;
+		ret = inflate(&gZstream,Z_SYNC_FLUSH);
+		if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) return -1;
+		gZoutLen = 4096 - gZstream.avail_out;
+		gZoutPos = 0;
+		if(ret == Z_STREAM_END)
+		{
+			/* server is back to plain text, keep the bytes after the stream */
+			memcpy(gZout+gZoutLen,gZstream.next_in,gZstream.avail_in);
+			gZoutLen += gZstream.avail_in;
+			inflateEnd(&gZstream);
+			gZlib = 0;
+		}
+	}
+	*c = gZout[gZoutPos++];
+	return 1;
+}
+
+int zlib_pending(void)
+{
+	/* decoded bytes which select() on socket can not see */
+	return gZoutPos < gZoutLen || (gZlib && gZstream.avail_in > 0);
+}
+
+int framed_session(int fd,int line_fd)
+{
+	/* one request at a time: send a line, print its output frames and status */
+	char line[30000];
+	char header[8];
+	int len,flags;
+	if(read_frames(fd) < 0) return -1;   // status 0 answers the switching line
+	while((len = readline(line_fd,line,sizeof(line)-2)) > 0)
+	{
+		while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) len--;
+		line[len] = '\0';
+		printf("%s\r\n",line);
+		fflush(stdout);
+		header[0] = (len >> 24) & 0xff;
+		header[1] = (len >> 16) & 0xff;
+		header[2] = (len >> 8) & 0xff;
+		header[3] = len & 0xff;
+		header[4] = 1;   // FRAME_REQUEST
+		header[5] = header[6] = header[7] = 0;
+		if(write(fd,header,8) == -1 || write(fd,line,len) == -1) return -1;
+		if((flags = read_frames(fd)) < 0) return -1;
+		if(flags & 4) return 0;   // FRAME_STATUS_EXIT, the server closes now
+		if(!strcmp(line,"setenv RAS_PROTOCOL text")) return 0;
+	}
+	return 0;
+}
+
+int read_frames(int fd)
+{
+	/* print output frames up to a status frame, shown without its times.
+	 * return the status flags, -1 for error */
+	char header[8];
+	char buf[4096];
+	unsigned int len,seq,stages,i,n;
+	int type,flags,status;
+	while(1)
+	{
+		if(read_full(fd,header,8) < 0) return -1;
+		len = get_u32(header);
+		type = header[4];
+		flags = header[5];
+		if(type == 2)   // FRAME_OUTPUT
+		{
+			while(len > 0)
+			{
+				n = len < sizeof(buf) ? len : sizeof(buf);
+				if(read_full(fd,buf,n) < 0) return -1;
+				fwrite(buf,1,n,stdout);
+				len -= n;
+			}
+			continue;
+		}
+		if(type != 3 || len < 16 || len > sizeof(buf)) return -1;   // FRAME_STATUS
+		if(read_full(fd,buf,len) < 0) return -1;
+		seq = get_u32(buf);
+		stages = get_u32(buf+4);
+		printf("[status %u:",seq);
+		for(i=0;i<stages && 16+i*8+8 <= len;i++)
+		{
+			status = (int)get_u32(buf+16+i*8);
+			if(WIFEXITED(status)) printf(" exit %d",WEXITSTATUS(status));
+			else printf(" signal %d",WTERMSIG(status));
+		}
+		if(flags & 1) printf(" internal");
+		if(flags & 2) printf(" aborted");
+		if(flags & 4) printf(" exit");
+		printf("]\n");
+		fflush(stdout);
+		return flags;
+	}
+}
+
+int read_full(int fd,char *buf,int len)
+{
+	int n;
+	for(n=0;n<len;n++)
+		if(read_byte(fd,buf+n) != 1) return -1;
+	return len;
+}
+
+unsigned int get_u32(const char *buf)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
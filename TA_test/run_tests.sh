@@ -0,0 +1,122 @@
+#!/bin/sh
+# run every test_data/testN.txt and aheadN.txt at once and diff with test_ans.
+# usage: ./run_tests.sh [ras binary] [extra ras args...]
+# needs "make" here first: commands/bin and client.
+#
+# the answers were made by running the tests one after another in one
+# directory, later tests see files written by earlier ones. so the root a
+# test starts with is built first: a script writing files ("> file") is run
+# with --batch on a copy of the root before it, which takes milliseconds.
+# then every test gets its own server with --root-template, each session
+# works in a private copy, and all clients run in parallel.
+#
+# aheadN.txt mix file writes and reads. the client sends such a script at
+# once, so lines queue up and lookahead plans them. each runs twice from the
+# plain root, once with --run-ahead, and both must match the same answer.
+
+cd "$(dirname "$0")" || exit 1
+RAS=${1:-../ras}
+[ $# -gt 0 ] && shift
+case "$RAS" in /*) ;; *) RAS="$(pwd)/$RAS" ;; esac
+# commands the answers list in bin/
+TEST_COMMANDS="cat ls noop number removetag removetag0"
+
+if [ ! -x client ] || [ ! -d commands/bin ]; then
+    echo "run make in TA_test first" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/ras-tests.XXXXXX") || exit 1
+server_pids=""
+trap 'kill $server_pids 2>/dev/null; rm -rf "$WORK_DIR"' EXIT
+trap 'exit 1' INT TERM
+mkdir "$WORK_DIR/root0" "$WORK_DIR/root0/bin" "$WORK_DIR/out" "$WORK_DIR/run"
+for command in $TEST_COMMANDS; do
+    cp "commands/bin/$command" "$WORK_DIR/root0/bin/"
+done
+cp ras_data/* "$WORK_DIR/root0/"
+
+# a run: script, answer, starting root, ras flag and client mode, in $WORK_DIR/run/<run>.*
+runs=""
+add_run(){
+    runs="$runs $1"
+    echo "test_data/$2.txt" > "$WORK_DIR/run/$1.script"
+    echo "test_ans/$2_ans" > "$WORK_DIR/run/$1.answer"
+    echo "$3" > "$WORK_DIR/run/$1.root"
+    echo "$4" > "$WORK_DIR/run/$1.flag"
+    echo "$5" > "$WORK_DIR/run/$1.mode"
+}
+
+start=$(date +%s)
+# in number order, test10 comes after test9
+root="$WORK_DIR/root0"
+root_count=0
+i=1
+while [ -f "test_data/test$i.txt" ]; do
+    test_file="test_data/test$i.txt"
+    add_run "test$i" "test$i" "$root" "" ""
+    if grep -q ">" "$test_file"; then
+        root_count=$((root_count+1))
+        cp -R "$root" "$WORK_DIR/root$root_count"
+        root="$WORK_DIR/root$root_count"
+        "$RAS" --batch "$test_file" --root "$root" > /dev/null 2>&1
+    fi
+    i=$((i+1))
+done
+i=1
+while [ -f "test_data/ahead$i.txt" ]; do
+    add_run "ahead$i" "ahead$i" "$WORK_DIR/root0" "" "burst"
+    add_run "ahead$i-run-ahead" "ahead$i" "$WORK_DIR/root0" "--run-ahead" "burst"
+    i=$((i+1))
+done
+
+# unix sockets: no port to pick, parallel runs do not collide. TCP gets an ephemeral port.
+for run in $runs; do
+    "$RAS" 0 --unix "$WORK_DIR/$run.sock" --root-template "$(cat "$WORK_DIR/run/$run.root")" \
+      $(cat "$WORK_DIR/run/$run.flag") "$@" > "$WORK_DIR/$run.log" 2>&1 &
+    server_pids="$server_pids $!"
+done
+for run in $runs; do
+    tries=0
+    while [ ! -S "$WORK_DIR/$run.sock" ]; do
+        tries=$((tries+1))
+        if [ $tries -gt 50 ]; then
+            echo "ras for $run did not start:" >&2
+            cat "$WORK_DIR/$run.log" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+done
+
+client_pids=""
+for run in $runs; do
+    ./client "$WORK_DIR/$run.sock" 0 "$(cat "$WORK_DIR/run/$run.script")" $(cat "$WORK_DIR/run/$run.mode") \
+      > "$WORK_DIR/out/$run" 2>/dev/null &
+    client_pids="$client_pids $!"
+done
+for client_pid in $client_pids; do
+    wait $client_pid
+done
+end=$(date +%s)
+
+# "[1] 12345" of a started job, the pid differs from run to run
+for run in $runs; do
+    sed 's/^\(\[[0-9]*\]\) [0-9][0-9]*\r\{0,1\}$/\1 PID/' "$WORK_DIR/out/$run" > "$WORK_DIR/out/$run.pid"
+    mv "$WORK_DIR/out/$run.pid" "$WORK_DIR/out/$run"
+done
+
+pass=0
+fail=0
+for run in $runs; do
+    answer=$(cat "$WORK_DIR/run/$run.answer")
+    if diff -q "$WORK_DIR/out/$run" "$answer" > /dev/null; then
+        pass=$((pass+1))
+    else
+        fail=$((fail+1))
+        echo "$run: FAIL"
+        diff "$WORK_DIR/out/$run" "$answer" | head -20
+    fi
+done
+echo "pass $pass, fail $fail, $((end-start)) s"
+[ $fail -eq 0 ]
@@ -0,0 +1,210 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <new>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "admission.h"
+#include "io_wrapper.h"
+
+using namespace std;
+
+static AdmissionState* admission_state = NULL; /* NULL when admission control is off */
+static int admission_slot = -1;                /* slot of this session process */
+static double session_tokens = ADMISSION_FORK_BURST;
+static struct timespec session_last_refill;
+
+AdmissionStats admission_stats;
+
+/* admission sub functions */
+double timespec_diff_sec(const struct timespec& start, const struct timespec& end){
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void count_sessions(int& active_sessions, int& running_children){
+    active_sessions = 0;
+    running_children = 0;
+    for( int i=0; i<ADMISSION_MAX_SESSIONS; i++ ){
+        AdmissionSlot& slot = admission_state->slots[i];
+        if( slot.pid.load() == 0 )
+            continue;
+        active_sessions += 1;
+        running_children += slot.running_children.load();
+    }
+}
+
+bool try_take_token(const struct timespec& now){
+    /* global and per-session bucket, per-session rate is the fair share */
+    if( pthread_mutex_lock(&admission_state->lock) == EOWNERDEAD )
+        pthread_mutex_consistent(&admission_state->lock); /* a session died holding it */
+    double elapsed = timespec_diff_sec(admission_state->last_refill, now);
+    admission_state->tokens += elapsed * ADMISSION_FORKS_PER_SEC;
+    if( admission_state->tokens > ADMISSION_FORK_BURST )
+        admission_state->tokens = ADMISSION_FORK_BURST;
+    admission_state->last_refill = now;
+
+    int active_sessions, running_children;
+    count_sessions(active_sessions, running_children);
+    if( active_sessions == 0 )
+        active_sessions = 1;
+
+    double session_rate = ADMISSION_FORKS_PER_SEC / active_sessions;
+    session_tokens += timespec_diff_sec(session_last_refill, now) * session_rate;
+    if( session_tokens > ADMISSION_FORK_BURST )
+        session_tokens = ADMISSION_FORK_BURST;
+    session_last_refill = now;
+
+    int children_share = ADMISSION_MAX_CHILDREN / active_sessions;
+    if( children_share < 1 )
+        children_share = 1;
+    int my_children = admission_state->slots[admission_slot].running_children.load();
+
+    bool admitted = admission_state->tokens >= 1.0 && session_tokens >= 1.0
+        && running_children < ADMISSION_MAX_CHILDREN && my_children < children_share;
+    if( admitted ){
+        admission_state->tokens -= 1.0;
+        session_tokens -= 1.0;
+    }
+    pthread_mutex_unlock(&admission_state->lock);
+    return admitted;
+}
+
+void robust_mutex_init(pthread_mutex_t* lock){
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* admission */
+void admission_init(){
+    /* shared by listener and every forked session */
+    void* mem = mmap(NULL, sizeof(AdmissionState), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if( mem == MAP_FAILED )
+        perror_and_exit("mmap admission state error");
+
+    admission_state = new (mem) AdmissionState;
+    robust_mutex_init(&admission_state->lock);
+    admission_state->tokens = ADMISSION_FORK_BURST;
+    clock_gettime(CLOCK_MONOTONIC, &admission_state->last_refill);
+    for( int i=0; i<ADMISSION_MAX_SESSIONS; i++ ){
+        admission_state->slots[i].pid.store(0);
+        admission_state->slots[i].running_children.store(0);
+    }
+}
+
+int admission_accept_connection(socketfd_t listen_socket, socketfd_t connection_socket){
+    /* return free slot for the new session, or -1 after telling client to come back later */
+    if( !admission_state )
+        return 0;
+
+    /* claim slot with own pid, pre-forked workers accept concurrently */
+    int free_slot = -1;
+    for( int i=0; i<ADMISSION_MAX_SESSIONS && free_slot == -1; i++ ){
+        int expected_pid = 0;
+        if( admission_state->slots[i].pid.compare_exchange_strong(expected_pid, getpid()) )
+            free_slot = i;
+    }
+
+    bool overloaded = (free_slot == -1);
+    double load[1];
+    if( getloadavg(load, 1) == 1 && load[0] > ADMISSION_MAX_LOAD )
+        overloaded = true;
+#if defined(__linux__) && defined(TCP_INFO)
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    if( getsockopt(listen_socket, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0
+        && (int)info.tcpi_unacked > ADMISSION_MAX_ACCEPT_QUEUE )
+        overloaded = true; /* tcpi_unacked is accept queue length on listener */
+#endif
+
+    if( overloaded ){
+        const char busy_msg[] = "** Server is busy now, please try again later. **\n";
+        write_all(connection_socket, busy_msg, strlen(busy_msg));
+        if( free_slot != -1 )
+            admission_state->slots[free_slot].pid.store(0);
+        return -1;
+    }
+    admission_state->slots[free_slot].running_children.store(0);
+    return free_slot;
+}
+
+void admission_session_forked(int slot, int pid){
+    if( !admission_state ) return;
+    admission_state->slots[slot].pid.store(pid);
+}
+
+void admission_session_exited(int pid){
+    /* called from SIGCHLD handler, atomics only */
+    if( !admission_state ) return;
+    for( int i=0; i<ADMISSION_MAX_SESSIONS; i++ ){
+        if( admission_state->slots[i].pid.load() == pid ){
+            admission_state->slots[i].running_children.store(0);
+            admission_state->slots[i].pid.store(0);
+            return;
+        }
+    }
+}
+
+void admission_session_start(int slot){
+    if( !admission_state ) return;
+    admission_slot = slot;
+    admission_state->slots[slot].pid.store(getpid());
+    session_tokens = ADMISSION_FORK_BURST;
+    clock_gettime(CLOCK_MONOTONIC, &session_last_refill);
+    memset(&admission_stats, 0, sizeof(admission_stats));
+}
+
+void admission_session_end(){
+    /* pre-forked worker goes back to accept, free its slot */
+    if( !admission_state || admission_slot == -1 ) return;
+    admission_state->slots[admission_slot].running_children.store(0);
+    admission_state->slots[admission_slot].pid.store(0);
+    admission_slot = -1;
+}
+
+void admission_acquire_fork(){
+    /* wait for a fork token, at most ADMISSION_MAX_WAIT_MS, then fork anyway */
+    admission_stats.forks += 1;
+    if( !admission_state || admission_slot == -1 )
+        return;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    now = start;
+    bool queued = false;
+    while( !try_take_token(now) ){
+        if( !queued ){
+            queued = true;
+            admission_stats.queued += 1;
+        }
+        if( timespec_diff_sec(start, now) * 1000 >= ADMISSION_MAX_WAIT_MS ){
+            admission_stats.overruns += 1;
+            break;
+        }
+        struct timespec backoff = {0, 1000000};
+        nanosleep(&backoff, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    admission_stats.waited_ms += timespec_diff_sec(start, now) * 1000;
+    admission_state->slots[admission_slot].running_children.fetch_add(1);
+}
+
+void admission_release_fork(){
+    if( !admission_state || admission_slot == -1 )
+        return;
+    admission_state->slots[admission_slot].running_children.fetch_sub(1);
+}
+
+void admission_print_stats(){
+    error_print("admission: forks %ld, queued %ld, overruns %ld, waited %.3f ms\n",
+      admission_stats.forks, admission_stats.queued, admission_stats.overruns, admission_stats.waited_ms);
+}
@@ -0,0 +1,62 @@
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#include <atomic>
+#include <ctime>
+
+#include <pthread.h>
+
+#include "socket.h"
+
+/* shared-memory token bucket consulted by every session before fork,
+ * and connection admission for the listener. */
+const int ADMISSION_MAX_SESSIONS = 256;       /* session slots, also session cap */
+const double ADMISSION_FORKS_PER_SEC = 2000.0; /* global fork rate */
+const double ADMISSION_FORK_BURST = 200.0;    /* global bucket size */
+const int ADMISSION_MAX_CHILDREN = 64;        /* global concurrent children */
+const int ADMISSION_MAX_WAIT_MS = 2000;       /* bounded queueing before fork */
+const double ADMISSION_MAX_LOAD = 32.0;       /* 1 minute load average */
+const int ADMISSION_MAX_ACCEPT_QUEUE = 64;    /* pending connections on listener */
+
+struct AdmissionSlot{
+    std::atomic<int> pid;              /* 0 for free slot */
+    std::atomic<int> running_children;
+};
+
+struct AdmissionState{
+    pthread_mutex_t lock;   /* protects token bucket */
+    double tokens;
+    struct timespec last_refill;
+    AdmissionSlot slots[ADMISSION_MAX_SESSIONS];
+};
+
+struct AdmissionStats{
+    long forks;
+    long queued;      /* forks which had to wait */
+    long overruns;    /* forks which waited ADMISSION_MAX_WAIT_MS and went on */
+    double waited_ms;
+};
+
+extern AdmissionStats admission_stats;
+
+void admission_init();
+
+/* listener side */
+int admission_accept_connection(socketfd_t listen_socket, socketfd_t connection_socket);
+void admission_session_forked(int slot, int pid);
+void admission_session_exited(int pid);
+
+/* session side */
+void admission_session_start(int slot);
+void admission_session_end();
+void admission_acquire_fork();
+void admission_release_fork();
+void admission_print_stats();
+
+/* admission sub functions */
+double timespec_diff_sec(const struct timespec& start, const struct timespec& end);
+void count_sessions(int& active_sessions, int& running_children);
+bool try_take_token(const struct timespec& now);
+void robust_mutex_init(pthread_mutex_t* lock);
+
+#endif
@@ -0,0 +1,79 @@
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+#include "bench.h"
+
+using namespace std;
+
+int main(int argc, char** argv){
+    /* usage: ras_bench [name prefix] > result.json, progress goes to stderr */
+    BenchRunner runner(argc > 1 ? argv[1] : NULL);
+    bench_parser(runner);
+    bench_pipe_manager(runner);
+    bench_io(runner);
+    bench_string(runner);
+    runner.measure();
+    runner.print_json(stdout);
+    return 0;
+}
+
+BenchRunner::BenchRunner(const char* filter){
+    this->filter = filter;
+}
+
+void BenchRunner::run(const char* name, BenchBody body){
+    /* calibrate now, samples are taken by measure() */
+    if( filter && strncmp(name, filter, strlen(filter)) != 0 )
+        return;
+
+    long iterations = 1;
+    while( time_sample(body, iterations) < BENCH_SAMPLE_SECONDS && iterations < (1L << 40) )
+        iterations *= 2;
+
+    BenchResult result;
+    result.name = name;
+    result.body = body;
+    result.iterations = iterations;
+    results.push_back(result);
+}
+
+void BenchRunner::measure(){
+    /* one sample of every benchmark per round */
+    for( int round=0; round<BENCH_SAMPLES; round++ ){
+        for( auto& result : results ){
+            double seconds = time_sample(result.body, result.iterations);
+            result.samples_ns_per_op.push_back(seconds * 1e9 / result.iterations);
+        }
+    }
+
+    for( auto& result : results ){
+        vector<double>& samples = result.samples_ns_per_op;
+        sort(samples.begin(), samples.end());
+        result.ns_per_op = samples[samples.size() / 2];
+        result.min_ns_per_op = samples[0];
+        fprintf(stderr, "%-32s %12.1f ns/op  (min %.1f, %ld iterations)\n",
+          result.name.c_str(), result.ns_per_op, result.min_ns_per_op, result.iterations);
+    }
+}
+
+void BenchRunner::print_json(FILE* out) const{
+    fprintf(out, "{\n  \"benchmarks\": [\n");
+    for( size_t i=0; i<results.size(); i++ ){
+        const BenchResult& result = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f, \"min_ns_per_op\": %.1f}%s\n",
+          result.name.c_str(), result.iterations, result.ns_per_op, result.min_ns_per_op,
+          i+1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+double BenchRunner::time_sample(BenchBody& body, long iterations){
+    /* return seconds */
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    body(iterations);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
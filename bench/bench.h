@@ -0,0 +1,50 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <functional>
+using namespace std;
+
+/* microbenchmarks of ras components, run by "make bench".
+ * a body runs the measured operation `iterations` times. */
+typedef function<void(long iterations)> BenchBody;
+
+const double BENCH_SAMPLE_SECONDS = 0.1; /* iterations are doubled until a sample takes this long */
+const int BENCH_SAMPLES = 7;             /* rounds over all benchmarks, machine drift hits all alike */
+
+struct BenchResult{
+    string name;
+    BenchBody body;     /* captures by value, runs after the suite function returned */
+    long iterations;    /* per sample */
+    vector<double> samples_ns_per_op;
+    double ns_per_op;   /* median */
+    double min_ns_per_op;
+};
+
+struct BenchRunner{
+    const char* filter; /* run only names starting with filter, NULL for all */
+    vector<BenchResult> results;
+
+    BenchRunner(const char* filter);
+    void run(const char* name, BenchBody body);
+    void measure();
+    void print_json(FILE* out) const;
+
+    double time_sample(BenchBody& body, long iterations);
+};
+
+/* suites */
+void bench_parser(BenchRunner& runner);
+void bench_pipe_manager(BenchRunner& runner);
+void bench_io(BenchRunner& runner);
+void bench_string(BenchRunner& runner);
+
+/* keep the compiler from dropping a result nobody reads */
+template <typename T>
+inline void bench_keep(const T& value){
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+#endif
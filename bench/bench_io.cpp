@@ -0,0 +1,54 @@
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "bench.h"
+#include "../io_wrapper.h"
+#include "../session_output.h"
+
+using namespace std;
+
+const int BENCH_PIPE_SIZE = 65536; /* default pipe capacity, a write never blocks */
+
+void bench_io(BenchRunner& runner){
+    /* fds live until the benchmark process exits */
+    int pipe_fds[2];
+    if( pipe(pipe_fds) == -1 )
+        perror_and_exit("pipe error");
+    int read_fd = pipe_fds[0], write_fd = pipe_fds[1];
+    int null_fd = open("/dev/null", O_WRONLY);
+    if( null_fd == -1 )
+        perror_and_exit("open /dev/null error");
+    static char buf[BENCH_PIPE_SIZE];
+    memset(buf, 'x', sizeof(buf));
+
+    runner.run("write_all_pipe_4k", [=](long iterations){
+        char read_buf[4096];
+        for( long i=0; i<iterations; i++ ){
+            write_all(write_fd, buf, 4096);
+            if( read(read_fd, read_buf, 4096) != 4096 )
+                perror_and_exit("read error");
+        }
+    });
+
+    /* child output forwarding as done after every line, pipe filled by write_all first */
+    runner.run("forward_from_pipe_64k_splice", [=](long iterations){
+        SessionOutput output(null_fd);
+        for( long i=0; i<iterations; i++ ){
+            write_all(write_fd, buf, BENCH_PIPE_SIZE);
+            if( output.forward_from_pipe(read_fd, BENCH_PIPE_SIZE) != BENCH_PIPE_SIZE )
+                perror_and_exit("forward error");
+        }
+    });
+
+    runner.run("forward_from_pipe_64k_copy", [=](long iterations){
+        SessionOutput output(null_fd);
+        output.splice_enabled = false;
+        for( long i=0; i<iterations; i++ ){
+            write_all(write_fd, buf, BENCH_PIPE_SIZE);
+            if( output.forward_from_pipe(read_fd, BENCH_PIPE_SIZE) != BENCH_PIPE_SIZE )
+                perror_and_exit("forward error");
+        }
+    });
+}
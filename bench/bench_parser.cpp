@@ -0,0 +1,57 @@
+#include <string>
+
+#include "bench.h"
+#include "../parser.h"
+
+using namespace std;
+
+void bench_parser(BenchRunner& runner){
+    /* OneLineCommand::parse_one_line_cmd and fetch_word, command_str is consumed so
+     * every iteration parses a fresh copy. */
+    const string short_line = "ls -l | cat";
+
+    string long_line = "ls";
+    for( int i=0; i<200; i++ )
+        long_line += " | number";
+    long_line += " | cat";
+
+    const string redirection_line = "removetag test.html < in.txt > out.txt |2 number < a.txt |1 "
+        "cat > b.txt | cat < c.txt | removetag0 test.html |3 noop > c.txt | cat < d.txt >3";
+
+    runner.run("parser_short_line", [=](long iterations){
+        for( long i=0; i<iterations; i++ ){
+            string command = short_line;
+            OneLineCommand parsed_cmds;
+            parsed_cmds.parse_one_line_cmd(command);
+            bench_keep(parsed_cmds);
+        }
+    });
+
+    runner.run("parser_long_line_201_cmds", [=](long iterations){
+        for( long i=0; i<iterations; i++ ){
+            string command = long_line;
+            OneLineCommand parsed_cmds;
+            parsed_cmds.parse_one_line_cmd(command);
+            bench_keep(parsed_cmds);
+        }
+    });
+
+    runner.run("parser_redirection_line", [=](long iterations){
+        for( long i=0; i<iterations; i++ ){
+            string command = redirection_line;
+            OneLineCommand parsed_cmds;
+            parsed_cmds.parse_one_line_cmd(command);
+            bench_keep(parsed_cmds);
+        }
+    });
+
+    runner.run("parser_fetch_word_8_words", [=](long iterations){
+        OneLineCommand parsed_cmds;
+        for( long i=0; i<iterations; i++ ){
+            string command = "  removetag   test.html\tnumber cat  noop ls -l  number  ";
+            while( !parsed_cmds.fetch_word(command).empty() )
+                ;
+            bench_keep(command);
+        }
+    });
+}
@@ -0,0 +1,35 @@
+#include "bench.h"
+#include "../pipe_manager.h"
+
+using namespace std;
+
+void bench_pipe_manager(BenchRunner& runner){
+    /* bookkeeping of one command: has it an input pipe, look ahead, move to the next.
+     * runner doubles iterations, a sample covers millions of commands. */
+    runner.run("pipe_manager_next_pipe", [](long iterations){
+        PipeManager cmd_pipe_manager;
+        for( long i=0; i<iterations; i++ ){
+            bench_keep(cmd_pipe_manager.cmd_has_pipe(0));
+            bench_keep(cmd_pipe_manager.get_pipe(2));
+            cmd_pipe_manager.next_pipe();
+        }
+    });
+
+    /* same, every command pipes to the next one (pipe2 and two closes) */
+    runner.run("pipe_manager_pipe_per_cmd", [](long iterations){
+        PipeManager cmd_pipe_manager;
+        for( long i=0; i<iterations; i++ ){
+            cmd_pipe_manager.get_pipe(1).create_pipe();
+            cmd_pipe_manager.next_pipe();
+        }
+    });
+
+    runner.run("pipe_pool_acquire_release", [](long iterations){
+        PipePool pipe_pool;
+        for( long i=0; i<iterations; i++ ){
+            AnonyPipe pipe;
+            pipe_pool.acquire(pipe);
+            pipe_pool.release(pipe);
+        }
+    });
+}
@@ -0,0 +1,26 @@
+#include <string>
+
+#include "bench.h"
+#include "../string_more.h"
+
+using namespace std;
+
+void bench_string(BenchRunner& runner){
+    const string padded = " \t  removetag test.html | number  \r\n";
+    const string bare = "removetag test.html | number";
+
+    runner.run("string_strip_padded", [=](long iterations){
+        for( long i=0; i<iterations; i++ )
+            bench_keep(strip(padded));
+    });
+
+    runner.run("string_strip_bare", [=](long iterations){
+        for( long i=0; i<iterations; i++ )
+            bench_keep(strip(bare));
+    });
+
+    runner.run("string_lstrip_rstrip", [=](long iterations){
+        for( long i=0; i<iterations; i++ )
+            bench_keep(rstrip(lstrip(padded)));
+    });
+}
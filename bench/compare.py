@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+"""Compare ras_bench JSON results against a baseline.
+
+usage: compare.py baseline.json result.json [threshold_percent]
+
+Prints every benchmark found in both files and exits 1 if any of them is
+slower than the baseline by more than threshold_percent (default 5).
+The fastest sample (min_ns_per_op) is compared, it is the least disturbed
+by other load on the machine; the median is printed alongside.
+"""
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return {b["name"]: b for b in json.load(f)["benchmarks"]}
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(__doc__)
+    baseline = load(sys.argv[1])
+    result = load(sys.argv[2])
+    threshold = float(sys.argv[3]) if len(sys.argv) > 3 else 5.0
+
+    regressions = 0
+    for name, new in result.items():
+        old = baseline.get(name)
+        if old is None:
+            print("%-40s %12.1f ns/op  (new)" % (name, new["ns_per_op"]))
+            continue
+        change = (new["min_ns_per_op"] - old["min_ns_per_op"]) * 100.0 / old["min_ns_per_op"]
+        flag = ""
+        if change > threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        print("%-32s min %10.1f -> %10.1f ns/op  %+6.1f%%  (median %.1f)%s"
+              % (name, old["min_ns_per_op"], new["min_ns_per_op"], change, new["ns_per_op"], flag))
+    for name in baseline:
+        if name not in result:
+            print("%-40s missing in result" % name)
+
+    if regressions:
+        print("%d benchmark(s) regressed more than %.1f%%" % (regressions, threshold))
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
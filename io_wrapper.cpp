@@ -35,7 +35,7 @@ int write_all(int fd, const void* buf, size_t count){
     size_t writen_size = 0;
     const void* cur_buf = buf;
     while(writen_size < count){
-        int size = write(fd, buf, count - writen_size);
+        int size = write(fd, cur_buf, count - writen_size);
         if(size < 0)
             return size;
 
@@ -0,0 +1,173 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "jobs.h"
+#include "io_wrapper.h"
+
+using namespace std;
+
+/* struct JobTable */
+Job* JobTable::add(int pid, const string& text, AnonyPipe& output){
+    Job job;
+    job.id = next_id();
+    job.pid = pid;
+    job.text = text;
+    job.output = output;
+    job.done = false;
+    job.status = 0;
+
+    auto it = jobs.begin();
+    while( it != jobs.end() && it->id < job.id )
+        ++it;
+    return &*jobs.insert(it, job);
+}
+
+Job* JobTable::find(int id){
+    for( auto& job : jobs ){
+        if( job.id == id )
+            return &job;
+    }
+    return NULL;
+}
+
+Job* JobTable::last(){
+    /* most recently started, what "fg" takes without an argument */
+    Job* latest = NULL;
+    for( auto& job : jobs ){
+        if( !latest || job.pid > latest->pid )
+            latest = &job;
+    }
+    return latest;
+}
+
+int JobTable::next_id() const{
+    /* smallest free number, ids restart at 1 once every job is announced */
+    int id = 1;
+    for( const auto& job : jobs ){
+        if( job.id != id )
+            break;
+        id += 1;
+    }
+    return id;
+}
+
+void JobTable::poll_finished(){
+    for( auto& job : jobs ){
+        if( !job.done && waitpid(job.pid, &job.status, WNOHANG) == job.pid )
+            job.done = true;
+    }
+}
+
+int JobTable::wait_job(Job& job){
+    /* return -1 for error */
+    while( !job.done ){
+        if( waitpid(job.pid, &job.status, 0) == job.pid )
+            job.done = true;
+        else if( errno != EINTR )
+            return -1;
+    }
+    return 0;
+}
+
+void JobTable::report_finished(SessionOutput& client_output){
+    /* before the prompt, every finished job in id order */
+    poll_finished();
+    for( size_t i=0; i<jobs.size(); ){
+        if( jobs[i].done )
+            report(jobs[i], client_output, false);
+        else
+            i++;
+    }
+}
+
+void JobTable::report(Job& job, SessionOutput& client_output, bool as_foreground){
+    /* notice and captured output of a waited job, the job is removed */
+    if( !as_foreground ){
+        char notice[JOBS_NOTICE_SIZE];
+        int size = snprintf(notice, sizeof(notice), "[%d] %s\t%s\n", job.id,
+          job_state_text(job.status).c_str(), job.text.c_str());
+        if( size >= (int)sizeof(notice) ){
+            size = sizeof(notice) - 1;
+            notice[size-1] = '\n';
+        }
+        client_output.write(notice, size);
+    }
+
+    long output_size = lseek(job.output.write_fd(), 0, SEEK_END);
+    if( output_size > 0 && client_output.forward_from_file(job.output.read_fd(), output_size) < 0 )
+        perror_and_exit("forward job output error");
+    job.output.close_pipe();
+    jobs.erase(jobs.begin() + (&job - jobs.data()));
+}
+
+void JobTable::list(SessionOutput& client_output){
+    /* "jobs": finished ones are announced right away, then the running ones */
+    report_finished(client_output);
+    for( const auto& job : jobs ){
+        char line[JOBS_NOTICE_SIZE];
+        int size = snprintf(line, sizeof(line), "[%d] Running\t%s\n", job.id, job.text.c_str());
+        client_output.write(line, min(size, (int)sizeof(line)-1));
+    }
+}
+
+void JobTable::kill_all(){
+    /* session is over, nobody would see the output */
+    for( auto& job : jobs ){
+        if( !job.done ){
+            kill(-job.pid, SIGTERM);
+            wait_job(job);
+        }
+        job.output.close_pipe();
+    }
+    jobs.clear();
+}
+
+void JobTable::forget(){
+    /* forked job runner: the other jobs belong to the session */
+    for( auto& job : jobs )
+        job.output.close_pipe();
+    jobs.clear();
+}
+
+/* jobs sub functions */
+int parse_job_id(const string& arg){
+    /* "2" or "%2", -1 for anything else */
+    const char* digits = arg.c_str() + (arg[0] == '%' ? 1 : 0);
+    char* end;
+    long id = strtol(digits, &end, 10);
+    if( *digits == '\0' || *end != '\0' || id <= 0 || id > JOBS_MAX )
+        return -1;
+    return (int)id;
+}
+
+string job_state_text(int status){
+    if( WIFEXITED(status) && WEXITSTATUS(status) == 0 )
+        return "Done";
+    if( WIFEXITED(status) )
+        return "Exit " + to_string(WEXITSTATUS(status));
+    if( WIFSIGNALED(status) )
+        return strsignal(WTERMSIG(status));
+    return "Unknown";
+}
+
+bool line_is_self_contained(const OneLineCommand& parsed){
+    /* every numbered pipe of the line ends at a command of the same line */
+    for( int i=0; i<parsed.cmd_count; i++ ){
+        const Redirection& output = parsed.cmds[i].std_output;
+        if( output.kind != REDIR_PIPE )
+            continue;
+        if( i + output.data.pipe_index_in_manager >= parsed.cmd_count )
+            return false;
+        for( int target : output.data.fanout_pipe_indexes ){
+            if( i + target >= parsed.cmd_count )
+                return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef __JOBS_H__
+#define __JOBS_H__
+
+#include <vector>
+#include <string>
+
+#include "parser.h"
+#include "pipe_manager.h"
+#include "session_output.h"
+using namespace std;
+
+/* background jobs of a session: a line ending with "&" runs in a forked job
+ * runner, leader of its own process group, while the session goes on reading
+ * lines. the runner executes the line like the session would and writes its
+ * output into a file backed pipe. a finished job is announced before the next
+ * prompt with its captured output, "fg" waits for one and shows its output as
+ * if it had run in the foreground. a job only uses numbered pipes inside its
+ * own line, it is not counted by the numbered pipes of other lines. */
+const int JOBS_MAX = 16;           /* running and unannounced jobs of a session */
+const int JOBS_NOTICE_SIZE = 256;  /* notice line, long command text is cut */
+
+struct Job{
+    int id;          /* [1], [2]..., smallest free number */
+    int pid;         /* job runner, also its process group */
+    string text;     /* line without "&" */
+    AnonyPipe output;
+    bool done;
+    int status;      /* wait status of the runner */
+};
+
+struct JobTable{
+    vector<Job> jobs; /* ordered by id */
+
+    Job* add(int pid, const string& text, AnonyPipe& output);
+    Job* find(int id);
+    Job* last();
+    int next_id() const;
+    void poll_finished();
+    int wait_job(Job& job);
+    void report_finished(SessionOutput& client_output);
+    void report(Job& job, SessionOutput& client_output, bool as_foreground);
+    void list(SessionOutput& client_output);
+    void kill_all();
+    void forget();
+};
+
+/* jobs sub functions */
+int parse_job_id(const string& arg);
+string job_state_text(int status);
+bool line_is_self_contained(const OneLineCommand& parsed);
+
+#endif
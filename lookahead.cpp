@@ -0,0 +1,248 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "lookahead.h"
+#include "io_wrapper.h"
+#include "protocol.h"
+#include "admission.h"
+#include "spawner.h"
+
+using namespace std;
+
+/* struct PlannedLine */
+PlannedLine::PlannedLine(){
+    pid = -1;
+    by_spawner = false;
+}
+
+/* struct Lookahead */
+Lookahead::Lookahead(){
+    queue = NULL;
+    queue_end = NULL;
+    queue_framed = false;
+    stats = LookaheadStats{};
+}
+
+Lookahead::~Lookahead(){
+    discard();
+}
+
+void Lookahead::set_queue(const char* queue, const char* queue_end, bool queue_framed){
+    /* only valid while the line before it runs, cmd_buf moves afterwards */
+    this->queue = queue;
+    this->queue_end = queue_end;
+    this->queue_framed = queue_framed;
+}
+
+void Lookahead::plan_ahead(){
+    /* called while a child runs, the session would only wait otherwise */
+    if( !queue || planned.size() >= (size_t)LOOKAHEAD_MAX_LINES )
+        return;
+
+    const char* cursor = queue;
+    string text;
+    for( size_t i=0; i<planned.size(); i++ ){
+        if( !next_queued_line(cursor, queue_end, queue_framed, text) )
+            return;
+    }
+    while( planned.size() < (size_t)LOOKAHEAD_MAX_LINES ){
+        if( !next_queued_line(cursor, queue_end, queue_framed, text) )
+            return;
+        PlannedLine plan;
+        plan.text = text;
+        if( !plan_line(plan.text, plan.parsed) )
+            return;
+        planned.push_back(std::move(plan));
+        stats.planned += 1;
+    }
+}
+
+bool Lookahead::take(const char* line, PlannedLine& plan){
+    /* plan of line if it is the next one, a different line makes every plan stale */
+    if( planned.empty() )
+        return false;
+    if( planned.front().text != line ){
+        discard();
+        return false;
+    }
+    plan = std::move(planned.front());
+    planned.pop_front();
+    stats.used += 1;
+    OneLineCommand& parsed = plan.parsed;
+
+    /* "< file" replaced since it was opened, reopen at exec */
+    for( auto& cmd : parsed.cmds ){
+        int& preopened_fd = cmd.std_input.data.preopened_fd;
+        if( preopened_fd < 0 )
+            continue;
+        struct stat opened, current;
+        if( fstat(preopened_fd, &opened) < 0 || stat(cmd.std_input.data.filename.c_str(), &current) < 0 ||
+          opened.st_dev != current.st_dev || opened.st_ino != current.st_ino ){
+            close(preopened_fd);
+            preopened_fd = -1;
+        }
+    }
+    return true;
+}
+
+void Lookahead::file_written(const string& filename){
+    /* "> filename" of the running line, drop plans reading or running it */
+    for( const auto& plan : planned ){
+        for( const auto& cmd : plan.parsed.cmds ){
+            if( (cmd.std_input.kind == REDIR_FILE && cmd.std_input.data.filename == filename) ||
+              cmd.executable == filename || cmd.exec_path == filename || cmd.exec_path == "./" + filename ){
+                discard();
+                return;
+            }
+        }
+    }
+}
+
+void Lookahead::discard(){
+    /* started lines are always the next ones and taken before anything discards,
+     * reap them anyway if that ever breaks, their output is lost */
+    for( auto& plan : planned ){
+        if( plan.pid > 0 ){
+            int status;
+            error_print("lookahead: dropped started line: %s\n", plan.text.c_str());
+            wait_started_line(plan, &status);
+        }
+        close_preopened(plan.parsed);
+        plan.output.close_pipe();
+    }
+    stats.discarded += planned.size();
+    planned.clear();
+}
+
+void Lookahead::forget(){
+    /* forked job runner: plans and started lines belong to the session,
+     * close what was inherited without reaping anything */
+    for( auto& plan : planned ){
+        close_preopened(plan.parsed);
+        plan.output.close_pipe();
+    }
+    planned.clear();
+    set_queue(NULL, NULL, false);
+}
+
+void Lookahead::print_stats() const{
+    error_print("lookahead: planned %ld, used %ld, discarded %ld, started %ld\n",
+      stats.planned, stats.used, stats.discarded, stats.started);
+}
+
+/* lookahead sub functions */
+bool next_queued_line(const char*& cursor, const char* queue_end, bool queue_framed, string& text){
+    /* complete line or FRAME_REQUEST at cursor, false if it is still arriving */
+    if( queue_framed ){
+        if( queue_end - cursor < FRAME_HEADER_SIZE || cursor[4] != FRAME_REQUEST )
+            return false;
+        uint32_t length = frame_get_u32(cursor);
+        if( length > (uint32_t)LOOKAHEAD_MAX_LINE_SIZE || queue_end - cursor - FRAME_HEADER_SIZE < (long)length )
+            return false;
+        text.assign(cursor + FRAME_HEADER_SIZE, length);
+        cursor += FRAME_HEADER_SIZE + length;
+        return true;
+    }
+
+    const char* newline_char = strchr(cursor, '\n');
+    if( !newline_char || newline_char - cursor > LOOKAHEAD_MAX_LINE_SIZE )
+        return false;
+    text.assign(cursor, newline_char - cursor);
+    cursor = newline_char + 1;
+    return true;
+}
+
+bool plan_line(const string& text, OneLineCommand& parsed){
+    /* false stops planning: empty line, parse error, background job, or
+     * internal command which may change what later lines resolve to */
+    string command = text;
+    if( parsed.parse_one_line_cmd(command) == CMD_ERROR || parsed.cmd_count == 0 || parsed.background )
+        return false;
+    for( const auto& cmd : parsed.cmds ){
+        if( cmd.is_internal() )
+            return false;
+    }
+
+    for( auto& cmd : parsed.cmds ){
+        resolve_executable(cmd.executable, cmd.exec_path);
+        if( cmd.std_input.kind == REDIR_FILE )
+            cmd.std_input.data.preopened_fd = preopen_input(cmd.std_input.data.filename);
+    }
+    return true;
+}
+
+bool runs_independently(const OneLineCommand& parsed){
+    /* no numbered pipe, no file written, no builtin: only its output tells it ran */
+    if( parsed.cmd_count != 1 )
+        return false;
+    const SingleCommand& cmd = parsed.cmds[0];
+    return (cmd.std_input.kind == REDIR_NONE || cmd.std_input.kind == REDIR_FILE) &&
+      cmd.std_output.kind == REDIR_NONE && cmd.std_error.kind == REDIR_NONE && !cmd.is_internal();
+}
+
+int wait_started_line(PlannedLine& plan, int* status){
+    /* reap a started line, its output stays in plan.output. return -1 for error */
+    int ret;
+    if( plan.by_spawner )
+        ret = spawner_wait(plan.pid, status);
+    else
+        ret = waitpid(plan.pid, status, 0);
+    admission_release_fork();
+    plan.pid = -1;
+    return ret < 0 ? -1 : 0;
+}
+
+bool resolve_executable(const string& name, string& path){
+    /* first executable regular file along PATH, like execvp searches.
+     * names with '/' are left to execvp. */
+    path.clear();
+    const char* env_path = getenv("PATH");
+    if( name.empty() || name.find('/') != string::npos || !env_path )
+        return false;
+
+    const char* dir_head = env_path;
+    while( 1 ){
+        const char* dir_end = strchr(dir_head, ':');
+        size_t dir_len = dir_end ? (size_t)(dir_end - dir_head) : strlen(dir_head);
+        string candidate = dir_len ? string(dir_head, dir_len) + "/" + name : "./" + name;
+
+        struct stat file_stat;
+        if( stat(candidate.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+          access(candidate.c_str(), X_OK) == 0 ){
+            path = candidate;
+            return true;
+        }
+        if( !dir_end )
+            return false;
+        dir_head = dir_end + 1;
+    }
+}
+
+int preopen_input(const string& filename){
+    /* regular files only, a fifo would block or lose its writer's data */
+    int fd = open(filename.c_str(), O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+    if( fd < 0 )
+        return -1;
+    struct stat file_stat;
+    if( fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode) ){
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
+
+void close_preopened(OneLineCommand& parsed){
+    for( auto& cmd : parsed.cmds ){
+        if( cmd.std_input.data.preopened_fd >= 0 ){
+            close(cmd.std_input.data.preopened_fd);
+            cmd.std_input.data.preopened_fd = -1;
+        }
+    }
+}
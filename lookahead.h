@@ -0,0 +1,74 @@
+#ifndef __LOOKAHEAD_H__
+#define __LOOKAHEAD_H__
+
+#include <deque>
+#include <string>
+
+#include <ctime>
+
+#include "parser.h"
+#include "pipe_manager.h"
+using namespace std;
+
+/* while a command of the current line runs, the session plans the lines
+ * already buffered behind it: parse, resolve executables through PATH and
+ * open "< file" inputs. a plan is used only if its line comes next with
+ * the same text, planning stops at internal commands (setenv may change
+ * PATH), and all plans are dropped when a line writes a file one of them uses.
+ *
+ * with --run-ahead, planned lines which can not affect each other are started
+ * right away, out of order, when nothing pipes into the commands ahead. each
+ * writes into its own file backed output, committed to the client when its
+ * turn comes, so the client sees the same bytes in the same order. a line runs
+ * ahead if it is a single command with no pipe and no "> file": commands are
+ * assumed to change nothing but their output, as every command in bin/ does.
+ * that is not checked, so it is off by default. */
+const int LOOKAHEAD_MAX_LINES = 8;
+const int LOOKAHEAD_MAX_LINE_SIZE = 4096; /* longer lines may run in pieces, not planned */
+
+struct PlannedLine{
+    string text;            /* line without newline, as execute_cmd will get it */
+    OneLineCommand parsed;  /* exec_path and preopened_fd filled */
+    int pid;                /* started out of order, -1 if not */
+    bool by_spawner;
+    AnonyPipe output;       /* file backed stdout and stderr of a started line */
+    struct timespec start;
+
+    PlannedLine();
+};
+
+struct LookaheadStats{
+    long planned;   /* lines parsed ahead */
+    long used;      /* plans taken by execute_cmd */
+    long discarded; /* plans dropped, stale or not reached */
+    long started;   /* lines run out of order */
+};
+
+struct Lookahead{
+    deque<PlannedLine> planned; /* plans of the lines right after the running one, in order */
+    const char* queue;          /* buffered input after the running line, NULL if none */
+    const char* queue_end;      /* end of frames, text lines end at '\0' instead */
+    bool queue_framed;          /* queue holds FRAME_REQUEST frames instead of text lines */
+    LookaheadStats stats;
+
+    Lookahead();
+    ~Lookahead();
+    void set_queue(const char* queue, const char* queue_end, bool queue_framed);
+    void plan_ahead();
+    bool take(const char* line, PlannedLine& plan);
+    void file_written(const string& filename);
+    void discard();
+    void forget();
+    void print_stats() const;
+};
+
+/* lookahead sub functions */
+bool next_queued_line(const char*& cursor, const char* queue_end, bool queue_framed, string& text);
+bool plan_line(const string& text, OneLineCommand& parsed);
+bool runs_independently(const OneLineCommand& parsed);
+int wait_started_line(PlannedLine& plan, int* status);
+bool resolve_executable(const string& name, string& path);
+int preopen_input(const string& filename);
+void close_preopened(OneLineCommand& parsed);
+
+#endif
@@ -10,11 +10,13 @@ using namespace std;
 /* struct Redirection */
 Redirection::Redirection(){
     kind = REDIR_NONE; 
+    data.preopened_fd = -1;
 }
 
 void Redirection::set_file_redirect(string filename){
     kind = REDIR_FILE;
     data.filename = filename;
+    data.preopened_fd = -1;
 }
 
 void Redirection::set_to_person_redirect(int person_id){
@@ -25,6 +27,22 @@ void Redirection::set_to_person_redirect(int person_id){
 void Redirection::set_pipe_redirect(int pipe_index_in_manager){
     kind = REDIR_PIPE;
     data.pipe_index_in_manager = pipe_index_in_manager;
+    data.fanout_pipe_indexes.clear();
+}
+
+void Redirection::add_pipe_target(int pipe_index_in_manager){
+    /* same pipe twice would get the output twice */
+    if( pipe_index_in_manager == data.pipe_index_in_manager )
+        return;
+    for( int pipe_index : data.fanout_pipe_indexes ){
+        if( pipe_index == pipe_index_in_manager )
+            return;
+    }
+    data.fanout_pipe_indexes.push_back(pipe_index_in_manager);
+}
+
+bool Redirection::is_fanout() const{
+    return kind == REDIR_PIPE && !data.fanout_pipe_indexes.empty();
 }
 
 void Redirection::print() const{
@@ -35,7 +53,10 @@ void Redirection::print() const{
         printf("redirect to file: %s\n", data.filename.c_str());
     }
     else if( kind == REDIR_PIPE ){
-        printf("redirect to pipe, pipe index = %d\n", data.pipe_index_in_manager);
+        printf("redirect to pipe, pipe index = %d", data.pipe_index_in_manager);
+        for( int pipe_index : data.fanout_pipe_indexes )
+            printf(", %d", pipe_index);
+        printf("\n");
     }
     else if( kind == REDIR_TO_PERSON ){
         printf("redirect to person, id = %d\n", data.person_id);
@@ -86,10 +107,17 @@ void SingleCommand::free_argv(char** argv){
     delete [] argv;
 }
 
+bool SingleCommand::is_internal() const{
+    /* run by the session itself, see is_internal_command_and_run */
+    return executable == "exit" || executable == "printenv" || executable == "setenv" ||
+      executable == "jobs" || executable == "wait" || executable == "fg" || executable == "who";
+}
+
 /* struct OneLineCommand */
 OneLineCommand::OneLineCommand(){
     cmds = vector<SingleCommand>();
     cmd_count = 0;
+    background = false;
 }
 
 SingleCommand& OneLineCommand::current_cmd(){
@@ -111,6 +139,8 @@ void OneLineCommand::add_argv(string argument){
 
 void OneLineCommand::print() const{
     printf("command count: %d\n", cmd_count);
+    if( background )
+        printf("background: yes\n");
     for( const auto& cmd : cmds ){
         printf("exe: %s\n", cmd.executable.c_str());
         for( const auto& argument : cmd.arguments ){
@@ -199,6 +229,7 @@ int OneLineCommand::parse_redirection(string& command_str){
      *       : <number , <filename   , (NEXT_IS_REDIR_CHARS)
      *       : >number , >filename   , (NEXT_IS_REDIR_CHARS) 
      *       : |number command       , (NEXT_IS_CMD) 
+     *       : |number,number command, |number |number command , (NEXT_IS_CMD)
      *                 ^ command_str will be here after this function.
      *
      * return: NEXT_IS_CMD, NEXT_IS_REDIR_CHARS, NO_NEXT, CMD_ERROR
@@ -225,11 +256,13 @@ int OneLineCommand::parse_redirection(string& command_str){
         if( redir_num == -1 ) 
             redir_num = 1;
 
-        if( redir_num == 0 )
-            error_print_and_exit("pipe error: %s\n", command_str.substr(0, 2).c_str());
+        if( redir_num == 0 ){
+            this->parse_error = "pipe error: " + command_str.substr(0, 2);
+            return CMD_ERROR;
+        }
 
         this->current_cmd().std_output.set_pipe_redirect(redir_num);
-        return NEXT_IS_CMD;
+        return parse_pipe_fanout(command_str);
     }
     else if( char_belong_to(redir_char, FILE_REDIR_CHARS) ){
         if( redir_num != -1 ){
@@ -263,12 +296,48 @@ int OneLineCommand::parse_redirection(string& command_str){
     return CMD_ERROR;
 }
 
+int OneLineCommand::parse_pipe_fanout(string& command_str){
+    /* more targets right after "|number": ",number" or " |number", repeated
+     * return: NEXT_IS_CMD, CMD_ERROR */
+    while( 1 ){
+        std::size_t num_start;
+        if( command_str[0] == ',' ){
+            num_start = 1;
+        }
+        else{
+            std::size_t found = command_str.find_first_not_of(WHITESPACE);
+            if( found == string::npos || command_str[found] != '|' )
+                return NEXT_IS_CMD;
+            num_start = found + 1;
+        }
+        if( !(command_str[num_start] >= '0' && command_str[num_start] <= '9') )
+            return NEXT_IS_CMD;
+
+        std::size_t index_after_num = 0;
+        int redir_num = stoi(command_str.substr(num_start), &index_after_num);
+        if( redir_num == 0 ){
+            this->parse_error = "pipe error: " + command_str.substr(0, num_start+1);
+            return CMD_ERROR;
+        }
+        this->current_cmd().std_output.add_pipe_target(redir_num);
+        command_str = command_str.substr(num_start + index_after_num, string::npos);
+    }
+}
+
 int OneLineCommand::parse_one_line_cmd(string& command_str){
     /* parse one-line command, and store into OneLineCommand class
      * store array of commands
      * single command: (executable, arguments, stdin/stdout/stderr redirection)
+     * return: 0, or CMD_ERROR with parse_error set, nothing is printed here
      */
     string backup_command = command_str;
+
+    /* trailing "&" after a command: line runs as a background job */
+    size_t mark = background_mark(command_str);
+    if( mark != string::npos ){
+        background = true;
+        command_str.erase(mark);
+    }
     while( 1 ){
         /* parse command executable and arguments */
         int argc = parse_single_command(command_str);
@@ -286,9 +355,22 @@ int OneLineCommand::parse_one_line_cmd(string& command_str){
                 continue;
             else if( status == NO_NEXT )
                 return 0;
-            else if( status == CMD_ERROR )
-                error_print_and_exit("parsing command error %s\n", backup_command.c_str());
+            else if( status == CMD_ERROR ){
+                if( this->parse_error.empty() )
+                    this->parse_error = "parsing command error " + backup_command;
+                return CMD_ERROR;
+            }
         }
     }
     return 0;
 }
+
+/* parser sub functions */
+size_t background_mark(const string& command_str){
+    /* position of the "&" ending a line which runs as a job, npos if none */
+    size_t last_char = command_str.find_last_not_of(WHITESPACE);
+    if( last_char != string::npos && last_char > 0 && command_str[last_char] == '&' &&
+      command_str.find_last_not_of(WHITESPACE, last_char-1) != string::npos )
+        return last_char;
+    return string::npos;
+}
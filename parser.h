@@ -22,12 +22,16 @@ struct Redirection{
         string filename;
         int person_id;
         int pipe_index_in_manager;
+        vector<int> fanout_pipe_indexes; /* more targets of "|2,5" or "|2 |5", same output to each */
+        int preopened_fd;                /* "< file" already opened by lookahead, -1 if not */
     } data;
 
     Redirection();
     void set_file_redirect(string filename);
     void set_to_person_redirect(int person_id);
     void set_pipe_redirect(int pipe_index_in_manager);
+    void add_pipe_target(int pipe_index_in_manager);
+    bool is_fanout() const;
 
     void print() const;
 };
@@ -39,6 +43,7 @@ struct SingleCommand{
     Redirection std_input; // input redirection are both depend on here and PipeManager.
     Redirection std_output;
     Redirection std_error;
+    string exec_path;       /* executable resolved through PATH by lookahead, empty if not */
 
     SingleCommand();
     // void argv_array_alloc(int size = 256);
@@ -46,11 +51,14 @@ struct SingleCommand{
     void add_argv(string argument);
     char** gen_argv();
     void free_argv(char** argv);
+    bool is_internal() const;
 };
 
 struct OneLineCommand{
     vector<SingleCommand> cmds;
     int cmd_count;
+    string parse_error; /* why parse_one_line_cmd returned CMD_ERROR */
+    bool background;    /* line ended with "&", removed from the command */
 
     OneLineCommand();
 
@@ -64,9 +72,13 @@ struct OneLineCommand{
     int parse_single_command(string& command_str);
     int parse_redirection(string& command_str);
     /* return: NEXT_IS_CMD, NEXT_IS_REDIR_CHARS, NO_NEXT, CMD_ERROR */
+    int parse_pipe_fanout(string& command_str);
 
     string fetch_word(string& command_str);
 };
+/* parser sub functions */
+size_t background_mark(const string& command_str);
+
 const int CMD_ERROR = -1;
 const int NO_NEXT = 0;
 const int NEXT_IS_CMD = 1;
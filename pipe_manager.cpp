@@ -1,18 +1,29 @@
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <cerrno>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 
 #include "pipe_manager.h"
 #include "io_wrapper.h"
+#include "probes.h"
+
+using namespace std;
 
 /* AnonyPipe */
 AnonyPipe::AnonyPipe(){
     enable = false;
+    backing = PIPE_BACKING_PIPE;
     fd_is_closed[0] = false;
     fd_is_closed[1] = false;
     fds[0] = -1;
     fds[1] = -1;
+    capacity = 0;
 }
 
 int AnonyPipe::read_fd(){
@@ -27,43 +38,175 @@ int AnonyPipe::write_fd(){
     return fds[1];
 }
 
-int AnonyPipe::create_pipe(){
+int AnonyPipe::create_pipe(PipeBacking backing){
     if(enable) return ANONY_PIPE_PIPE_EXIST;
-    int ret = pipe(fds);
-    if(ret == -1) perror_and_exit("pipe error");
+    if(backing == PIPE_BACKING_FILE){
+        /* one read-write fd, producer appends and consumer reads from start */
+        int fd = create_backing_file();
+        fds[0] = fd;
+        fds[1] = fd;
+    }
+    else{
+        int ret = pipe2(fds, O_CLOEXEC);
+        if(ret == -1) perror_and_exit("pipe error");
+    }
+    capacity = 0;
+    this->backing = backing;
     enable = true;
     fd_is_closed[0] = false;
     fd_is_closed[1] = false;
+    RAS_PROBE3(pipe__create, fds[0], fds[1], backing);
     return ANONY_PIPE_NORMAL;
 }
 
+void AnonyPipe::prepare_read(){
+    /* file backed pipe: rewind to the first byte before the consumer is forked,
+     * the shared file offset is at the end after producers wrote. */
+    if(!enable) return;
+    if(backing != PIPE_BACKING_FILE) return;
+    if(fd_is_closed[1]) return;
+    if(lseek(fds[0], 0, SEEK_SET) == -1) perror_and_exit("lseek error");
+}
+
+int AnonyPipe::unread_bytes(){
+    /* bytes waiting in kernel pipe, 0 for file backed pipe */
+    if(!enable) return 0;
+    if(backing != PIPE_BACKING_PIPE) return 0;
+    if(fd_is_closed[0]) return 0;
+    int size = 0;
+    if(ioctl(fds[0], FIONREAD, &size) == -1) perror_and_exit("ioctl error");
+    return size;
+}
+
 void AnonyPipe::close_read(){
     if(!enable) return;
     if(fd_is_closed[0]) return;
-    int ret = close(fds[0]);
-    if(ret == -1) perror_and_exit("close error");
     fd_is_closed[0] = true;
+    close_fd_if_unused(0);
 }
 
 void AnonyPipe::close_write(){
     if(!enable) return;
     if(fd_is_closed[1]) return;
-    int ret = close(fds[1]);
-    if(ret == -1) perror_and_exit("close error");
     fd_is_closed[1] = true;
+    close_fd_if_unused(1);
+}
+
+void AnonyPipe::close_fd_if_unused(int end){
+    /* file backed pipe shares one fd, close it when both ends are closed */
+    if(backing == PIPE_BACKING_FILE && !fd_is_closed[1-end]) return;
+    int ret = close(fds[end]);
+    if(ret == -1) perror_and_exit("close error");
 }
 
 void AnonyPipe::close_pipe(){
     if(!enable) return;
+    RAS_PROBE2(pipe__close, fds[0], fds[1]);
     close_read();
     close_write();
     enable = false;
 }
 
+int create_backing_file(){
+    /* anonymous storage for file backed pipe, memfd if available */
+    int fd;
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("ras_pipe", MFD_CLOEXEC);
+    if(fd != -1) return fd;
+#endif
+    const char* tmp_dir = getenv("TMPDIR");
+    char path[1024+1];
+    snprintf(path, 1024, "%s/ras_pipe_XXXXXX", tmp_dir ? tmp_dir : "/tmp");
+    fd = mkstemp(path);
+    if(fd == -1) perror_and_exit("mkstemp error");
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/* PipePool */
+PipePool::PipePool(){
+    free_pipes = vector<AnonyPipe>();
+    pipe_capacity = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+PipePool::~PipePool(){
+    for( auto& pipe : free_pipes )
+        pipe.close_pipe();
+}
+
+void PipePool::acquire(AnonyPipe& pipe){
+    /* hand out a drained pipe if any, otherwise create one.
+     * grow its capacity if the pool observed more traffic than it holds. */
+    if( !free_pipes.empty() ){
+        pipe = free_pipes.back();
+        free_pipes.pop_back();
+        stats.hits += 1;
+    }
+    else{
+        pipe.create_pipe(PIPE_BACKING_PIPE);
+        stats.misses += 1;
+    }
+
+#ifdef F_SETPIPE_SZ
+    if( pipe_capacity > pipe.capacity ){
+        if( fcntl(pipe.fds[1], F_SETPIPE_SZ, pipe_capacity) != -1 ){
+            pipe.capacity = pipe_capacity;
+            stats.resizes += 1;
+        }
+    }
+#endif
+}
+
+void PipePool::release(AnonyPipe& pipe){
+    /* keep a pipe whose both ends are still open and nothing left inside,
+     * otherwise close it. */
+    bool reusable = pipe.enable && pipe.backing == PIPE_BACKING_PIPE
+        && !pipe.fd_is_closed[0] && !pipe.fd_is_closed[1]
+        && pipe.unread_bytes() == 0;
+
+    if( reusable && free_pipes.size() < PIPE_POOL_MAX_FREE ){
+        free_pipes.push_back(pipe);
+        stats.recycles += 1;
+        pipe = AnonyPipe();
+    }
+    else{
+        pipe.close_pipe();
+    }
+}
+
+void PipePool::observe_traffic(long moved_bytes){
+    /* a stage moving more than half of the capacity makes later pipes larger */
+    int wanted = PIPE_DEFAULT_CAPACITY;
+    while( wanted < moved_bytes * 2 && wanted < PIPE_MAX_CAPACITY )
+        wanted *= 2;
+    if( wanted > PIPE_DEFAULT_CAPACITY && wanted > pipe_capacity )
+        pipe_capacity = wanted;
+}
+
+void PipePool::trim(){
+    /* idle session gives its spare pipes back to kernel, acquire creates new ones */
+    for( auto& pipe : free_pipes )
+        pipe.close_pipe();
+    vector<AnonyPipe>().swap(free_pipes);
+}
+
+void PipePool::print_stats() const{
+    error_print("pipe pool: hits %ld, misses %ld, recycles %ld, resizes %ld, capacity %d\n",
+      stats.hits, stats.misses, stats.recycles, stats.resizes, pipe_capacity);
+}
+
 /* PipeManager */
-PipeManager::PipeManager(){
+PipeManager::PipeManager(int slots){
     cur_cmd_index = 0;
-    cmd_input_pipes = vector<AnonyPipe>(16, AnonyPipe());
+    cmd_input_pipes = vector<AnonyPipe>(slots, AnonyPipe());
+}
+
+PipeManager::~PipeManager(){
+    /* pipes still waiting for their command, process may serve another session */
+    for( auto& pipe : cmd_input_pipes )
+        pipe.close_pipe();
 }
 
 bool PipeManager::cmd_has_pipe(int next_n_cmd){
@@ -74,6 +217,15 @@ bool PipeManager::cmd_has_pipe(int next_n_cmd){
     return cmd_input_pipes[cmd_index].enable;
 }
 
+bool PipeManager::has_pending_pipes(){
+    /* any pipe into the current command or a later one */
+    for( size_t cmd_index=cur_cmd_index; cmd_index<cmd_input_pipes.size(); cmd_index++ ){
+        if( cmd_input_pipes[cmd_index].enable )
+            return true;
+    }
+    return false;
+}
+
 AnonyPipe& PipeManager::get_pipe(int next_n_cmd){
     int cmd_index = cur_cmd_index + next_n_cmd;
     if( cmd_index+1 > cmd_input_pipes.size() )
@@ -90,3 +242,87 @@ void PipeManager::next_pipe(){
     get_pipe(0).close_pipe();
     cur_cmd_index += 1;
 }
+
+void PipeManager::compact(){
+    /* drop slots of commands already run and empty slots at the end,
+     * numbered pipes keep their distance. get_pipe grows it again. */
+    cmd_input_pipes.erase(cmd_input_pipes.begin(), cmd_input_pipes.begin() + cur_cmd_index);
+    cur_cmd_index = 0;
+    while( !cmd_input_pipes.empty() && !cmd_input_pipes.back().enable )
+        cmd_input_pipes.pop_back();
+    cmd_input_pipes.shrink_to_fit();
+}
+
+long PipeManager::fan_out(const vector<int>& next_n_cmds){
+    /* move fanout_source into the pipes of next_n_cmds until its writers are gone,
+     * no byte passes through user space. tee can stop at a full target and cannot
+     * resume, so every extra target gets a tee into an empty scratch pipe of the
+     * same capacity, spliced on from there; the last target takes the source itself.
+     * a spliced chunk takes a whole buffer slot of the target pipe, so a producer
+     * writing byte by byte would fill it after 16 bytes. chunks under a page are
+     * copied instead, writes merge into the last page of the target.
+     * return moved size. */
+    AnonyPipe scratch;
+    pipe_pool.acquire(scratch);
+#ifdef F_SETPIPE_SZ
+    int source_size = fcntl(fanout_source.read_fd(), F_GETPIPE_SZ);
+    if( fcntl(scratch.write_fd(), F_GETPIPE_SZ) < source_size )
+        fcntl(scratch.write_fd(), F_SETPIPE_SZ, source_size);
+#endif
+
+    long moved_size = 0;
+    struct pollfd source_poll = {fanout_source.read_fd(), POLLIN, 0};
+    while( 1 ){
+        int ret = poll(&source_poll, 1, -1);
+        if( ret == -1 && errno == EINTR )
+            continue;
+        if( ret == -1 )
+            perror_and_exit("fan-out poll error");
+        int size = fanout_source.unread_bytes();
+        if( size == 0 ){
+            if( source_poll.revents & (POLLHUP|POLLERR) )
+                break;
+            continue;
+        }
+
+        if( size < PIPE_FANOUT_COPY_SIZE ){
+            char chunk[PIPE_FANOUT_COPY_SIZE];
+            if( read(fanout_source.read_fd(), chunk, size) != size )
+                perror_and_exit("fan-out read error");
+            for( int next_n_cmd : next_n_cmds )
+                if( write_all(get_pipe(next_n_cmd).write_fd(), chunk, size) < 0 )
+                    perror_and_exit("fan-out write error");
+            moved_size += size;
+            continue;
+        }
+        for( size_t i=0; i+1<next_n_cmds.size(); i++ ){
+            ssize_t tee_size = tee(fanout_source.read_fd(), scratch.write_fd(), size, 0);
+            if( tee_size != size )
+                perror_and_exit("fan-out tee error");
+            if( splice_all(scratch.read_fd(), get_pipe(next_n_cmds[i]).write_fd(), size) == -1 )
+                perror_and_exit("fan-out splice error");
+        }
+        if( splice_all(fanout_source.read_fd(), get_pipe(next_n_cmds.back()).write_fd(), size) == -1 )
+            perror_and_exit("fan-out splice error");
+        moved_size += size;
+    }
+
+    pipe_pool.release(scratch);
+    pipe_pool.release(fanout_source);
+    RAS_PROBE2(pipe__fanout, next_n_cmds.size(), moved_size);
+    return moved_size;
+}
+
+/* fan_out sub functions */
+int splice_all(int from_fd, int to_fd, int size){
+    /* kernel pipe or file backed pipe as target, file offset moves with the data */
+    while( size > 0 ){
+        ssize_t ret = splice(from_fd, NULL, to_fd, NULL, size, SPLICE_F_MOVE);
+        if( ret == -1 && errno == EINTR )
+            continue;
+        if( ret <= 0 )
+            return -1;
+        size -= ret;
+    }
+    return 0;
+}
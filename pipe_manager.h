@@ -11,20 +11,64 @@ const int ANONY_PIPE_FD_CLOSED  = -1;
 const int ANONY_PIPE_NO_PIPE    = -2;
 const int ANONY_PIPE_PIPE_EXIST = -4;
 
+enum PipeBacking{
+    PIPE_BACKING_PIPE,  /* kernel pipe, fds[0] and fds[1] */
+    PIPE_BACKING_FILE,  /* memfd or unlinked temp file, one fd for both ends */
+};
+
+/* stages run one after another, the consumer of a pipe into a later command
+ * ("|", "|1" as well as "|N") is never running yet: such pipes are file
+ * backed, so producer never blocks on pipe capacity. kernel pipes are the
+ * ones the session itself reads while the child runs (output, fan-out source). */
+
 struct AnonyPipe{
     bool enable;
+    PipeBacking backing;
     bool fd_is_closed[2];
     int fds[2];
+    int capacity; /* F_SETPIPE_SZ size, 0 for kernel default */
 
     AnonyPipe();
     int read_fd();
     int write_fd();
-    int create_pipe();
+    int create_pipe(PipeBacking backing = PIPE_BACKING_PIPE);
+    void prepare_read();
+    int unread_bytes();
     void close_read();
     void close_write();
     void close_pipe();
+    void close_fd_if_unused(int end);
 }; 
 
+int create_backing_file();
+
+/* struct PipePool */
+const int PIPE_POOL_MAX_FREE = 8;
+const int PIPE_DEFAULT_CAPACITY = 65536;
+const int PIPE_MAX_CAPACITY = 1048576; /* default /proc/sys/fs/pipe-max-size */
+const int PIPE_FANOUT_COPY_SIZE = 4096; /* fan-out copies smaller chunks, see fan_out */
+
+struct PipePoolStats{
+    long hits;      /* acquire served by a recycled pipe */
+    long misses;    /* acquire created a new pipe */
+    long recycles;  /* drained pipe kept for reuse */
+    long resizes;   /* F_SETPIPE_SZ growth */
+};
+
+struct PipePool{
+    vector<AnonyPipe> free_pipes;
+    int pipe_capacity; /* wanted capacity, grows with observed traffic */
+    PipePoolStats stats;
+
+    PipePool();
+    ~PipePool();
+    void acquire(AnonyPipe& pipe);
+    void release(AnonyPipe& pipe);
+    void observe_traffic(long moved_bytes);
+    void trim();
+    void print_stats() const;
+};
+
 /* struct PipeManager */
 /*
 enum PipeManagerErrorCode {
@@ -33,14 +77,25 @@ enum PipeManagerErrorCode {
     PIPE_MANAGER_PIPE_UNEXIST   = 0x04,
 };*/
 
+const int PIPE_MANAGER_SLOTS = 16; /* numbered pipe slots to start with, get_pipe grows them */
+
 struct PipeManager{
     int cur_cmd_index;
     vector<AnonyPipe> cmd_input_pipes;
+    PipePool pipe_pool;
+    AnonyPipe fanout_source; /* stdout of a "|2,5" command, copied into each target */
 
-    PipeManager();
+    PipeManager(int slots = PIPE_MANAGER_SLOTS);
+    ~PipeManager();
     bool cmd_has_pipe(int next_n_cmd);
+    bool has_pending_pipes();
     AnonyPipe& get_pipe(int next_n_cmd);
     void next_pipe();
+    void compact();
+    long fan_out(const vector<int>& next_n_cmds);
 };
 
+/* fan_out sub functions */
+int splice_all(int from_fd, int to_fd, int size);
+
 #endif
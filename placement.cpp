@@ -0,0 +1,223 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include "placement.h"
+#include "io_wrapper.h"
+
+using namespace std;
+
+static PlacementPolicy placement_policy = PLACEMENT_NONE;
+static bool placement_cpus_given = false;
+static cpu_set_t placement_allowed;                   /* --cpus, or affinity at start */
+static cpu_set_t placement_nodes[PLACEMENT_MAX_NODES]; /* allowed cpus of each node, numa only */
+static int placement_node_count = 0;
+
+/* placement sub functions */
+int parse_cpu_list(const char* list, cpu_set_t* set){
+    /* "0-3,8" style, return -1 for bad syntax, cpu out of range or empty list */
+    CPU_ZERO(set);
+    const char* cur = list;
+    while( *cur ){
+        if( !isdigit(*cur) )
+            return -1;
+        char* end;
+        long first = strtol(cur, &end, 10);
+        long last = first;
+        if( *end == '-' ){
+            if( !isdigit(end[1]) )
+                return -1;
+            last = strtol(end+1, &end, 10);
+        }
+        if( last < first || last >= CPU_SETSIZE )
+            return -1;
+        for( long cpu=first; cpu<=last; cpu++ )
+            CPU_SET(cpu, set);
+        if( *end == ',' && end[1] != '\0' )
+            end++;
+        else if( *end != '\0' && *end != '\n' )
+            return -1;
+        else
+            break;
+        cur = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+void format_cpu_list(const cpu_set_t* set, char* buf, int buf_size){
+    int len = 0;
+    buf[0] = '\0';
+    for( int cpu=0; cpu<CPU_SETSIZE && len<buf_size; cpu++ ){
+        if( !CPU_ISSET(cpu, set) )
+            continue;
+        int last = cpu;
+        while( last+1 < CPU_SETSIZE && CPU_ISSET(last+1, set) )
+            last++;
+        if( last == cpu )
+            len += snprintf(buf+len, buf_size-len, "%s%d", len ? "," : "", cpu);
+        else
+            len += snprintf(buf+len, buf_size-len, "%s%d-%d", len ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+int parse_sched_policy(const char* name){
+    /* return policy for sched_setscheduler, -1 for unknown name */
+    if( strcmp(name, "normal") == 0 )
+        return SCHED_OTHER;
+#ifdef SCHED_BATCH
+    if( strcmp(name, "batch") == 0 )
+        return SCHED_BATCH;
+#endif
+#ifdef SCHED_IDLE
+    if( strcmp(name, "idle") == 0 )
+        return SCHED_IDLE;
+#endif
+    return -1;
+}
+
+int read_numa_nodes(const cpu_set_t* allowed, cpu_set_t* nodes, int max_nodes){
+    /* allowed cpus of every node having some, return node count (0 without sysfs) */
+    int node_count = 0;
+    for( int node=0; node<PLACEMENT_MAX_NODES && node_count<max_nodes; node++ ){
+        char path[256];
+        snprintf(path, sizeof(path), "%s/node%d/cpulist", PLACEMENT_NODE_DIR, node);
+        int fd = open(path, O_RDONLY|O_CLOEXEC);
+        if( fd < 0 )
+            continue;
+        char cpu_list[PLACEMENT_CPU_LIST_SIZE] = {0};
+        int ret = read(fd, cpu_list, sizeof(cpu_list)-1);
+        close(fd);
+
+        cpu_set_t node_cpus;
+        if( ret <= 0 || parse_cpu_list(cpu_list, &node_cpus) < 0 )
+            continue;
+        CPU_AND(&node_cpus, &node_cpus, allowed);
+        if( CPU_COUNT(&node_cpus) > 0 )
+            nodes[node_count++] = node_cpus;
+    }
+    return node_count;
+}
+
+/* placement */
+void placement_init(const char* cpu_list, const char* policy){
+    /* before anything is forked, --cpus also confines the server itself */
+    if( policy ){
+        if( strcmp(policy, "rr") == 0 )
+            placement_policy = PLACEMENT_RR;
+        else if( strcmp(policy, "numa") == 0 )
+            placement_policy = PLACEMENT_NUMA;
+        else
+            error_print_and_exit("unknown placement: %s, rr or numa\n", policy);
+    }
+
+    if( cpu_list ){
+        if( parse_cpu_list(cpu_list, &placement_allowed) < 0 )
+            error_print_and_exit("bad cpu list: %s\n", cpu_list);
+        if( sched_setaffinity(0, sizeof(cpu_set_t), &placement_allowed) < 0 )
+            perror_and_exit("set cpu affinity error");
+        placement_cpus_given = true;
+    }
+    else if( sched_getaffinity(0, sizeof(cpu_set_t), &placement_allowed) < 0 ){
+        perror_and_exit("get cpu affinity error");
+    }
+
+    if( placement_policy == PLACEMENT_NUMA ){
+        placement_node_count = read_numa_nodes(&placement_allowed, placement_nodes, PLACEMENT_MAX_NODES);
+        if( placement_node_count == 0 ){
+            /* no sysfs, one node with everything */
+            placement_nodes[0] = placement_allowed;
+            placement_node_count = 1;
+        }
+    }
+
+    if( placement_enabled() ){
+        char allowed_str[PLACEMENT_CPU_LIST_SIZE];
+        format_cpu_list(&placement_allowed, allowed_str, sizeof(allowed_str));
+        if( placement_policy == PLACEMENT_NUMA )
+            error_print("placement: numa, cpus %s, %d nodes\n", allowed_str, placement_node_count);
+        else
+            error_print("placement: %s, cpus %s\n", placement_policy == PLACEMENT_RR ? "rr" : "none", allowed_str);
+    }
+}
+
+bool placement_enabled(){
+    return placement_policy != PLACEMENT_NONE || placement_cpus_given;
+}
+
+void placement_apply(int index){
+    /* pin the calling session or worker process, index is its slot */
+    if( placement_policy == PLACEMENT_NONE || index < 0 )
+        return;
+
+    cpu_set_t target;
+    if( placement_policy == PLACEMENT_RR ){
+        int nth = index % CPU_COUNT(&placement_allowed);
+        CPU_ZERO(&target);
+        for( int cpu=0; cpu<CPU_SETSIZE; cpu++ ){
+            if( CPU_ISSET(cpu, &placement_allowed) && nth-- == 0 ){
+                CPU_SET(cpu, &target);
+                break;
+            }
+        }
+    }
+    else{
+        target = placement_nodes[index % placement_node_count];
+    }
+
+    if( sched_setaffinity(0, sizeof(cpu_set_t), &target) < 0 )
+        perror("placement affinity error");
+}
+
+void placement_export_env(){
+    /* RAS_CPUS tells spawner children where the session runs, and shows it to the user */
+    if( !placement_enabled() )
+        return;
+    cpu_set_t current;
+    if( sched_getaffinity(0, sizeof(cpu_set_t), &current) < 0 )
+        return;
+    char cpu_list[PLACEMENT_CPU_LIST_SIZE];
+    format_cpu_list(&current, cpu_list, sizeof(cpu_list));
+    setenv("RAS_CPUS", cpu_list, 1);
+}
+
+bool sched_env_valid(const char* name, const char* value){
+    /* checked at setenv, sched_apply_env runs in the child and can not complain */
+    if( strcmp(name, "RAS_CPUS") == 0 ){
+        cpu_set_t set;
+        return parse_cpu_list(value, &set) == 0;
+    }
+    if( strcmp(name, "RAS_SCHED") == 0 )
+        return parse_sched_policy(value) != -1;
+    if( strcmp(name, "RAS_NICE") == 0 ){
+        char* end;
+        long nice_value = strtol(value, &end, 10);
+        return *value != '\0' && *end == '\0' && nice_value >= -20 && nice_value <= 19;
+    }
+    return true;
+}
+
+void sched_apply_env(){
+    /* command child right before exec, failures leave what was inherited */
+    const char* cpus = getenv("RAS_CPUS");
+    cpu_set_t set;
+    if( cpus && parse_cpu_list(cpus, &set) == 0 )
+        sched_setaffinity(0, sizeof(cpu_set_t), &set);
+
+    const char* sched = getenv("RAS_SCHED");
+    int policy = sched ? parse_sched_policy(sched) : -1;
+    if( policy != -1 ){
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        sched_setscheduler(0, policy, &param);
+    }
+
+    const char* nice_str = getenv("RAS_NICE");
+    if( nice_str && sched_env_valid("RAS_NICE", nice_str) )
+        setpriority(PRIO_PROCESS, 0, strtol(nice_str, NULL, 10));
+}
@@ -0,0 +1,39 @@
+#ifndef __PLACEMENT_H__
+#define __PLACEMENT_H__
+
+#include <sched.h>
+
+/* CPU placement of session processes, or of pre-forked workers (--cpus LIST
+ * --placement rr|numa). rr pins process i to the i-th cpu of LIST, numa to all
+ * cpus of the i-th NUMA node having cpus in LIST. command children inherit it,
+ * or override it from session environment right before exec:
+ *   RAS_CPUS  cpu list like "0-3,8", set by the session when placement is on
+ *   RAS_SCHED normal, batch or idle
+ *   RAS_NICE  nice value, only raising it works without privilege */
+enum PlacementPolicy{
+    PLACEMENT_NONE,
+    PLACEMENT_RR,
+    PLACEMENT_NUMA,
+};
+
+const char PLACEMENT_NODE_DIR[] = "/sys/devices/system/node";
+const int PLACEMENT_MAX_NODES = 64;
+const int PLACEMENT_CPU_LIST_SIZE = 1024;
+
+/* server side */
+void placement_init(const char* cpu_list, const char* policy);
+bool placement_enabled();
+void placement_apply(int index);
+
+/* session side */
+void placement_export_env();
+bool sched_env_valid(const char* name, const char* value);
+void sched_apply_env();
+
+/* placement sub functions */
+int parse_cpu_list(const char* list, cpu_set_t* set);
+void format_cpu_list(const cpu_set_t* set, char* buf, int buf_size);
+int parse_sched_policy(const char* name);
+int read_numa_nodes(const cpu_set_t* allowed, cpu_set_t* nodes, int max_nodes);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/* USDT probes of provider "ras", for bpftrace/perf on a running server:
+ *     bpftrace -l 'usdt:./ras:ras:*'
+ * with sys/sdt.h (systemtap-sdt-dev) a probe is one nop plus an ELF note,
+ * arguments are only evaluated when a tracer is attached.
+ * without sys/sdt.h, or built with -DRAS_NO_PROBES, probes compile to nothing:
+ * arguments only appear in sizeof, not evaluated, but a variable kept for a
+ * probe does not warn as unused.
+ * sample bpftrace scripts are in tools/. */
+#if !defined(RAS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RAS_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef RAS_HAVE_PROBES
+#define RAS_PROBE0(name)                     DTRACE_PROBE(ras, name)
+#define RAS_PROBE1(name, a1)                 DTRACE_PROBE1(ras, name, a1)
+#define RAS_PROBE2(name, a1, a2)             DTRACE_PROBE2(ras, name, a1, a2)
+#define RAS_PROBE3(name, a1, a2, a3)         DTRACE_PROBE3(ras, name, a1, a2, a3)
+#define RAS_PROBE4(name, a1, a2, a3, a4)     DTRACE_PROBE4(ras, name, a1, a2, a3, a4)
+#else
+#define RAS_PROBE0(name)                     do{ }while(0)
+#define RAS_PROBE1(name, a1)                 do{ (void)sizeof(a1); }while(0)
+#define RAS_PROBE2(name, a1, a2)             do{ (void)sizeof(a1); (void)sizeof(a2); }while(0)
+#define RAS_PROBE3(name, a1, a2, a3)         do{ RAS_PROBE2(name, a1, a2); (void)sizeof(a3); }while(0)
+#define RAS_PROBE4(name, a1, a2, a3, a4)     do{ RAS_PROBE3(name, a1, a2, a3); (void)sizeof(a4); }while(0)
+#endif
+
+/* probes, arguments in order:
+ *   line__start    (command string, before parsing)
+ *   line__end      (commands forked, wait status of the last one, 0 0 for internal command)
+ *   stage__fork    (stage index in line, child pid, executable)
+ *   stage__exit    (stage index in line, child pid, wait status, executable)
+ *   redirect       (fd 0/1/2, RedirectionType, pipe index or -1)
+ *   pipe__create   (read fd, write fd, PipeBacking)
+ *   pipe__close    (read fd, write fd)
+ *   pipe__fanout   (target count, bytes copied to each target)
+ *   cmd__read      (bytes read, bytes buffered)
+ *   output__forward(bytes forwarded to client)
+ */
+
+#endif
@@ -0,0 +1,29 @@
+#include "protocol.h"
+
+/* byte by byte, no htonl/be64toh differences between platforms */
+void frame_put_header(char* buf, uint32_t length, int type, int flags){
+    frame_put_u32(buf, length);
+    buf[4] = (char)type;
+    buf[5] = (char)flags;
+    buf[6] = 0;
+    buf[7] = 0;
+}
+
+void frame_put_u32(char* buf, uint32_t value){
+    for( int i=0; i<4; i++ )
+        buf[i] = (char)(value >> (24 - 8*i));
+}
+
+void frame_put_u64(char* buf, uint64_t value){
+    frame_put_u32(buf, (uint32_t)(value >> 32));
+    frame_put_u32(buf + 4, (uint32_t)value);
+}
+
+uint32_t frame_get_u32(const char* buf){
+    const unsigned char* bytes = (const unsigned char*)buf;
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+uint64_t frame_get_u64(const char* buf){
+    return ((uint64_t)frame_get_u32(buf) << 32) | frame_get_u32(buf + 4);
+}
@@ -0,0 +1,37 @@
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <cstdint>
+
+/* framed protocol for scripted clients: "setenv RAS_PROTOCOL framed" switches
+ * the session, "setenv RAS_PROTOCOL text" switches back. every frame is a
+ * header and payload, integers in network byte order. the client sends REQUEST
+ * frames without waiting for prompts, each is answered in order by OUTPUT
+ * frames and one STATUS frame. no "% " prompt is sent in framed mode. */
+const int FRAME_HEADER_SIZE = 8; /* u32 payload length, u8 FrameType, u8 flags, u16 zero */
+
+enum FrameType{
+    FRAME_REQUEST = 1, /* client: one command line, '\n' not needed */
+    FRAME_OUTPUT = 2,  /* server: output bytes of the current request */
+    FRAME_STATUS = 3,  /* server: request finished, flags are FrameStatusFlag */
+};
+
+/* STATUS payload: u32 request seq (0 for the text line switching to framed),
+ * u32 stage count, u64 line time in us, then per stage i32 wait status and
+ * u32 stage time in us. a stage is one forked command, in order. */
+const int FRAME_STATUS_FIXED_SIZE = 16;
+const int FRAME_STAGE_SIZE = 8;
+
+enum FrameStatusFlag{
+    FRAME_STATUS_INTERNAL = 1, /* setenv, printenv and so on, no stage */
+    FRAME_STATUS_ABORTED = 2,  /* a stage failed, rest of the line did not run */
+    FRAME_STATUS_EXIT = 4,     /* session closes after this frame */
+};
+
+void frame_put_header(char* buf, uint32_t length, int type, int flags);
+void frame_put_u32(char* buf, uint32_t value);
+void frame_put_u64(char* buf, uint64_t value);
+uint32_t frame_get_u32(const char* buf);
+uint64_t frame_get_u64(const char* buf);
+
+#endif
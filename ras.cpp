@@ -4,15 +4,24 @@
 #include <cstring>
 #include <cinttypes>
 #include <cerrno>
+#include <ctime>
 #include <vector>
+#include <algorithm>
 
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #include "socket.h"
 #include "io_wrapper.h"
@@ -20,112 +29,482 @@
 #include "pipe_manager.h"
 #include "cstring_more.h"
 #include "server_arch.h"
+#include "admission.h"
+#include "session_output.h"
+#include "spawner.h"
+#include "recorder.h"
+#include "protocol.h"
+#include "placement.h"
+#include "lookahead.h"
+#include "tunables.h"
+#include "jobs.h"
+#include "session_root.h"
+#include "session_registry.h"
+#include "probes.h"
+#include "uring.h"
 
 using namespace std;
 
 const char RAS_IP[] = "0.0.0.0";
-const int RAS_DEFAULT_PORT = 52000;
-const int MAX_ONELINE_CMD_SIZE = 65536;
-const int MAX_CMD_SIZE = 256;
+const int RAS_STREAM_WINDOW = 4096; /* unfinished line this long runs up to its last pipe */
+const char RAS_LISTEN_FD_ENV[] = "RAS_LISTEN_FD";
+const int RAS_STAGE_POLL_MS = 10; /* without pidfd, how often a running stage is checked */
 
+bool dump_parsed_cmds = true;
+vector<string> initial_environ; /* restored for every session, pre-forked worker serves many */
+Lookahead cmd_lookahead;        /* plans of buffered lines, filled while commands run */
+bool run_ahead_enabled = false; /* --run-ahead, planned lines may start out of order */
+JobTable session_jobs;          /* lines started with "&" */
+
+void ras_upgrade(const vector<socketfd_t>& listen_sockets, char** argv);
 void ras_service(socketfd_t client_socket);
-int execute_cmd(socketfd_t client_socket, PipeManager& cmd_pipe_manager, const char* origin_command);
+int ras_batch(const char* script_path, int repeat);
+struct StageReport{
+    int wait_status;
+    double elapsed_ms; /* fork to reaped */
+};
+struct LineState{
+    /* a long line runs in pieces, each piece ends with a pipe to the next one */
+    bool continued; /* earlier pieces ran, no internal command here */
+    bool aborted;   /* a command failed, rest of the line is dropped */
+    bool internal;  /* line was an internal command */
+    vector<StageReport> stages; /* for FRAME_STATUS */
+};
+int execute_cmd(SessionOutput& client_output, PipeManager& cmd_pipe_manager, const char* origin_command,
+  LineState* line_state = NULL);
     const int CMD_NORMAL = 0, CMD_EXIT = 1;
 
 /* ras_service sub functions */
 void ras_shell_init();
 void print_welcome_msg(socketfd_t client_socket);
-int read_cmd_from_socket_and_check_overflow(char* cmd_buf, int& cmd_size, socketfd_t client_socket);
+int read_cmd_from_socket_and_check_overflow(char* cmd_buf, int& cmd_size, socketfd_t client_socket,
+  SessionOutput& client_output, bool prompt);
+int execute_line_pieces(SessionOutput& client_output, PipeManager& cmd_pipe_manager, char*& cmd_head,
+  LineState& line_state, bool line_complete = true);
+char* find_stream_split(char* cmd_head);
+int execute_lines(SessionOutput& client_output, PipeManager& cmd_pipe_manager, char*& cmd_head,
+  LineState& line_state);
+int execute_frames(SessionOutput& client_output, PipeManager& cmd_pipe_manager, char*& cmd_head,
+  char* cmd_end);
+void write_status_frame(SessionOutput& client_output, const LineState& line_state,
+  const struct timespec& line_start, int status);
+
+/* ras_batch sub functions */
+double elapsed_ms(const struct timespec& start, const struct timespec& end);
+double timeval_ms(const struct timeval& tv);
 
 /* execute_cmd sub functions */
 void pre_fd_redirection(PipeManager& cmd_pipe_manager, int origin_fd, Redirection& redirect_obj);
+void prepare_output_pipe(PipeManager& cmd_pipe_manager, int pipe_index);
 void fd_redirection(PipeManager& cmd_pipe_manager, int origin_fd, Redirection& redirect_obj,
   AnonyPipe& child_output_pipe);
-bool is_internal_command_and_run(bool& is_exit, SingleCommand& cmd, socketfd_t client_socket);
-void processing_child_output_data(AnonyPipe& child_output_pipe, socketfd_t client_socket);
+void exec_child(PipeManager& cmd_pipe_manager, SingleCommand& cmd, AnonyPipe& child_output_pipe);
+void start_independent_lines(PipeManager& cmd_pipe_manager);
+int commit_started_line(SessionOutput& client_output, PipeManager& cmd_pipe_manager, PlannedLine& plan,
+  LineState* line_state);
+int start_background_job(SessionOutput& client_output, PipeManager& cmd_pipe_manager, OneLineCommand& parsed_cmds,
+  const char* origin_command);
+void run_background_job(SessionOutput& client_output, PipeManager& cmd_pipe_manager, const string& text,
+  AnonyPipe& job_output_pipe, pid_t session_pid);
+void job_runner_terminated(int sig);
+bool is_job_command_and_run(SingleCommand& cmd, SessionOutput& client_output);
+bool resolve_person_redirection(SessionOutput& client_output, OneLineCommand& parsed_cmds);
+int spawn_cmd_by_spawner(PipeManager& cmd_pipe_manager, SingleCommand& cmd, AnonyPipe& child_output_pipe);
+int redirection_fd(PipeManager& cmd_pipe_manager, int origin_fd, Redirection& redirect_obj,
+  AnonyPipe& child_output_pipe, bool& is_opened);
+bool is_internal_command_and_run(bool& is_exit, SingleCommand& cmd, SessionOutput& client_output);
+long processing_child_output_data(AnonyPipe& child_output_pipe, SessionOutput& client_output);
+int wait_stage_forwarding_output(int pid, bool by_spawner, int* child_status, AnonyPipe& child_output_pipe,
+  SessionOutput& client_output, long& output_size);
+int open_exit_fd(int pid);
 
 int main(int argc, char** argv){
-    int ras_port = RAS_DEFAULT_PORT;
-    if(argc == 2){
-        ras_port = strtol(argv[1], NULL, 0);
+    int ras_port = -1; /* from config if not given */
+    const char* batch_script = NULL;
+    int batch_repeat = 1;
+    int worker_count = 0;
+    bool use_spawner = false;
+    const char* record_path = NULL;
+    const char* cpu_list = NULL;
+    const char* placement = NULL;
+    const char* config_path = NULL;
+    vector<const char*> unix_paths;
+    const char* root = NULL;
+    const char* root_template = NULL;
+    int unix_mode = UNIX_SOCKET_DEFAULT_MODE;
+    for( int i=1; i<argc; i++ ){
+        if( strcmp(argv[i], "--batch") == 0 && i+1 < argc ){
+            batch_script = argv[++i];
+        }
+        else if( strcmp(argv[i], "--repeat") == 0 && i+1 < argc ){
+            batch_repeat = strtol(argv[++i], NULL, 0);
+        }
+        else if( strcmp(argv[i], "--workers") == 0 && i+1 < argc ){
+            worker_count = strtol(argv[++i], NULL, 0);
+        }
+        else if( strcmp(argv[i], "--spawner") == 0 ){
+            use_spawner = true;
+        }
+        else if( strcmp(argv[i], "--run-ahead") == 0 ){
+            run_ahead_enabled = true;
+        }
+        else if( strcmp(argv[i], "--no-uring") == 0 ){
+            uring_disable();
+        }
+        else if( strcmp(argv[i], "--record") == 0 && i+1 < argc ){
+            record_path = argv[++i];
+        }
+        else if( strcmp(argv[i], "--cpus") == 0 && i+1 < argc ){
+            cpu_list = argv[++i];
+        }
+        else if( strcmp(argv[i], "--placement") == 0 && i+1 < argc ){
+            placement = argv[++i];
+        }
+        else if( strcmp(argv[i], "--config") == 0 && i+1 < argc ){
+            config_path = argv[++i];
+        }
+        else if( strcmp(argv[i], "--unix") == 0 && i+1 < argc ){
+            unix_paths.push_back(argv[++i]);
+        }
+        else if( strcmp(argv[i], "--unix-mode") == 0 && i+1 < argc ){
+            if( !parse_int_in_range(argv[++i], 0, 0777, unix_mode) || argv[i][0] != '0' )
+                error_print_and_exit("bad unix socket mode: %s, octal like 0660\n", argv[i]);
+        }
+        else if( strcmp(argv[i], "--root") == 0 && i+1 < argc ){
+            root = argv[++i];
+        }
+        else if( strcmp(argv[i], "--root-template") == 0 && i+1 < argc ){
+            root_template = argv[++i];
+        }
+        else if( argv[i][0] != '-' ){
+            ras_port = strtol(argv[i], NULL, 0);
+        }
+        else{
+            error_print_and_exit("usage: %s [port] [--workers N] [--spawner] [--run-ahead] [--no-uring] [--record <file>] [--cpus LIST] [--placement rr|numa] [--config <file>] [--unix <path>]... [--unix-mode 0660] [--root <dir> | --root-template <dir>] | --batch <script> [--repeat N] [--spawner] [--root <dir> | --root-template <dir>]\n", argv[0]);
+        }
+    }
+
+    /* set by the previous image on upgrade, not a session variable.
+     * "3,5": every listener, TCP and unix */
+    vector<socketfd_t> ras_listen_sockets;
+    if( getenv(RAS_LISTEN_FD_ENV) ){
+        char* fd_str = getenv(RAS_LISTEN_FD_ENV);
+        while( *fd_str ){
+            char* end;
+            ras_listen_sockets.push_back(strtol(fd_str, &end, 10));
+            if( end == fd_str )
+                error_print_and_exit("bad %s\n", RAS_LISTEN_FD_ENV);
+            fd_str = (*end == ',') ? end+1 : end;
+        }
+        unsetenv(RAS_LISTEN_FD_ENV);
     }
-    
+
+    for( char** env = environ; *env; env++ )
+        initial_environ.push_back(string(*env));
+
+    tunables_init(config_path);
+    if( ras_port < 0 )
+        ras_port = tunables.port;
+
+    placement_init(cpu_list, placement);
+    session_root_init(root, root_template);
+
+    if( use_spawner ){
+        /* before anything else, the spawner image stays small */
+        spawner_start();
+    }
+
+    if( batch_script ){
+        /* offline mode: run script through execute_cmd, output to stdout */
+        return ras_batch(batch_script, batch_repeat);
+    }
+
     /* listening ras first */
-    socketfd_t ras_listen_socket;
-    ras_listen_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if( ras_listen_socket < 0 )
-        perror_and_exit("create socket error");
+    if( !ras_listen_sockets.empty() ){
+        /* upgraded in place, the sockets never stopped listening, --unix is not read again */
+        for( socketfd_t ras_listen_socket : ras_listen_sockets ){
+            int flags = fcntl(ras_listen_socket, F_GETFL);
+            if( flags < 0 )
+                perror_and_exit("inherited listen socket error");
+            fcntl(ras_listen_socket, F_SETFL, flags & ~O_NONBLOCK);
+            error_print("upgraded, listen socket %d inherited\n", ras_listen_socket);
+            tunables_apply_listen(ras_listen_socket);
+        }
+    }
+    else{
+        socketfd_t ras_listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if( ras_listen_socket < 0 )
+            perror_and_exit("create socket error");
+
+        int on = 1;
+        setsockopt(ras_listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+
+        if( socket_bind(ras_listen_socket, RAS_IP, ras_port) < 0 )
+            perror_and_exit("bind error");
+        if( listen(ras_listen_socket, tunables.listen_backlog) < 0 )
+            perror_and_exit("listen error");
+        tunables_apply_listen(ras_listen_socket);
+        ras_listen_sockets.push_back(ras_listen_socket);
 
-    // int on = 1;
-    // setsockopt(ras_listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+        /* the socket file stays after exit, the next start replaces it */
+        for( const char* unix_path : unix_paths ){
+            ras_listen_socket = socket_listen_unix(unix_path, unix_mode, tunables.listen_backlog);
+            if( ras_listen_socket < 0 ){
+                error_print("unix socket %s: ", unix_path);
+                perror_and_exit("listen error");
+            }
+            ras_listen_sockets.push_back(ras_listen_socket);
+        }
+    }
+
+    admission_init();
+    session_registry_init();
+    if( record_path )
+        recorder_open(record_path);
 
-    if( socket_bind(ras_listen_socket, RAS_IP, ras_port) < 0 )
-        perror_and_exit("bind error");
-    if( listen(ras_listen_socket, 1) < 0)
-        perror_and_exit("listen error");
+    while(1){
+        int ret;
+        if( worker_count > 0 )
+            ret = start_preforked_server(ras_listen_sockets, ras_service, worker_count);
+        else
+            ret = start_multiprocess_server(ras_listen_sockets, ras_service);
+        if( ret != SERVER_UPGRADE )
+            break;
 
-    start_multiprocess_server(ras_listen_socket, ras_service);
+        /* only returns if exec failed, keep serving with this image */
+        ras_upgrade(ras_listen_sockets, argv);
+        server_upgrade_requested = 0;
+    }
     return 0;
 }
 
+void ras_upgrade(const vector<socketfd_t>& listen_sockets, char** argv){
+    /* exec the binary now at argv[0], listen_sockets survive exec so
+     * no connection is refused while the new image starts */
+    string fd_str;
+    for( socketfd_t listen_socket : listen_sockets ){
+        fd_str += (fd_str.empty() ? "" : ",") + to_string(listen_socket);
+        int flags = fcntl(listen_socket, F_GETFD);
+        fcntl(listen_socket, F_SETFD, flags & ~FD_CLOEXEC);
+    }
+    setenv(RAS_LISTEN_FD_ENV, fd_str.c_str(), 1);
+
+    /* signal mask survives exec too */
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+
+    error_print("upgrade: exec %s\n", argv[0]);
+    execvp(argv[0], argv);
+
+    perror("upgrade exec error");
+    unsetenv(RAS_LISTEN_FD_ENV);
+}
+
 void ras_service(socketfd_t client_socket){
     /* client is connect to server, this function do ras service to client */
-    char cmd_buf[MAX_ONELINE_CMD_SIZE+1] = {0};
+    char* cmd_buf = new char[tunables.max_line_size+1]; /* not zero filled, pages are touched as lines come */
     int cmd_size = 0;
-    PipeManager cmd_pipe_manager;
+    tunables_apply_session(client_socket);
+    PipeManager cmd_pipe_manager(tunables.pipe_slots);
+    SessionOutput client_output(client_socket);
+    client_output.forward_chunk = tunables.forward_chunk;
 
     ras_shell_init();
+    spawner_session_connect();
+    uring_session_start(client_output);
     print_welcome_msg(client_socket);
+    recorder_session_start();
+    cmd_lookahead.stats = LookaheadStats{};
 
-    while(1){
-        write_all(client_socket, "% ", 2);
-
-        int recv_size = read_cmd_from_socket_and_check_overflow(cmd_buf, cmd_size, client_socket);
+    LineState line_state = {};
+    bool session_exit = false;
+    while( !session_exit ){
+        if( !line_state.continued ){
+            session_jobs.report_finished(client_output);
+            session_registry_set_state(SESSION_STATE_PROMPT);
+        }
+        bool prompt = !line_state.continued && !client_output.framed;
+        int recv_size = read_cmd_from_socket_and_check_overflow(cmd_buf, cmd_size, client_socket, client_output,
+          prompt);
         if(recv_size == 0)
             break;
+        session_registry_set_state(SESSION_STATE_RUNNING);
 
         char* cur_cmd_head = cmd_buf;
-        char* newline_char;
-        while( (newline_char = strchr(cur_cmd_head, '\n')) != NULL ){
-            /* split command and execute it. */
-            newline_char[0] = '\0';
-            if( execute_cmd(client_socket, cmd_pipe_manager, cur_cmd_head) == CMD_EXIT )
-                return;
-            cur_cmd_head = newline_char+1;
-        }
+        bool framed;
+        do{
+            /* a line may switch protocol, rest of the buffer is in the other one */
+            framed = client_output.framed;
+            int status;
+            if( framed )
+                status = execute_frames(client_output, cmd_pipe_manager, cur_cmd_head, cmd_buf + cmd_size);
+            else
+                status = execute_lines(client_output, cmd_pipe_manager, cur_cmd_head, line_state);
+            session_exit = (status == CMD_EXIT);
+        } while( !session_exit && client_output.framed != framed );
 
         if(cur_cmd_head != cmd_buf){
             /* move the un-executed command to start position of cmd_buf. */
             int used_byte = cur_cmd_head - cmd_buf;
             cmd_size -= used_byte;
             memmove(cmd_buf, cur_cmd_head, cmd_size);
+            cmd_buf[cmd_size] = '\0';
+        }
+    }
+    if( session_exit ){
+        client_output.flush();
+        client_output.drain();
+    }
+    recorder_append(RECORD_CLOSE, NULL, 0);
+    cmd_lookahead.discard();
+    session_jobs.kill_all();
+    session_root_leave();
+    uring_session_end();
+    client_output.print_stats();
+    uring_print_stats();
+    cmd_pipe_manager.pipe_pool.print_stats();
+    cmd_lookahead.print_stats();
+    admission_print_stats();
+    delete [] cmd_buf;
+}
+
+int ras_batch(const char* script_path, int repeat){
+    /* run every line of script_path through execute_cmd without socket,
+     * command output goes to stdout, per-line timing goes to stderr.
+     */
+    FILE* script = fopen(script_path, "r");
+    if( !script )
+        perror_and_exit("open batch script error");
+
+    dump_parsed_cmds = false;
+    spawner_session_connect();
+    char* line = NULL;
+    size_t line_cap = 0;
+
+    for( int run=1; run<=repeat; run++ ){
+        PipeManager cmd_pipe_manager(tunables.pipe_slots);
+        SessionOutput batch_output(STDOUT_FILENO);
+        batch_output.forward_chunk = tunables.forward_chunk;
+        ras_shell_init();
+        uring_session_start(batch_output);
+        rewind(script);
+
+        struct timespec run_start, run_end;
+        clock_gettime(CLOCK_MONOTONIC, &run_start);
+        int line_no = 0;
+        ssize_t line_len;
+        while( (line_len = getline(&line, &line_cap, script)) != -1 ){
+            line_no += 1;
+            if( line_len > 0 && line[line_len-1] == '\n' )
+                line[line_len-1] = '\0';
+
+            struct timespec line_start, line_end;
+            clock_gettime(CLOCK_MONOTONIC, &line_start);
+            LineState line_state = {};
+            char* line_head = line;
+            int status = execute_line_pieces(batch_output, cmd_pipe_manager, line_head, line_state);
+            if( status != CMD_EXIT )
+                status = execute_cmd(batch_output, cmd_pipe_manager, line_head, &line_state);
+            clock_gettime(CLOCK_MONOTONIC, &line_end);
+
+            error_print("[batch] run %d line %d: %.3f ms: %s\n", run, line_no,
+              elapsed_ms(line_start, line_end), line);
+            session_jobs.report_finished(batch_output);
+            if( status == CMD_EXIT )
+                break;
         }
+        /* a script does not leave jobs behind, the next run starts clean */
+        for( auto& job : session_jobs.jobs )
+            session_jobs.wait_job(job);
+        session_jobs.report_finished(batch_output);
+        session_root_leave();
+        uring_session_end();
+        clock_gettime(CLOCK_MONOTONIC, &run_end);
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        error_print("[batch] run %d: %d lines, %.3f ms, ras cpu user %.3f ms sys %.3f ms\n", run, line_no,
+          elapsed_ms(run_start, run_end), timeval_ms(usage.ru_utime), timeval_ms(usage.ru_stime));
+        batch_output.flush();
+        batch_output.print_stats();
+        uring_print_stats();
+        cmd_pipe_manager.pipe_pool.print_stats();
     }
+
+    free(line);
+    fclose(script);
+    return 0;
 }
 
-int execute_cmd(socketfd_t client_socket, PipeManager& cmd_pipe_manager, const char* origin_command){
-    /* parsing and execute shell command */
+int execute_cmd(SessionOutput& client_output, PipeManager& cmd_pipe_manager, const char* origin_command,
+  LineState* line_state){
+    /* parsing and execute shell command, origin_command may be a piece of a longer line */
     int cmd_len = strlen(origin_command);
     if( cmd_len == 0 ) 
         return CMD_NORMAL;
+    if( line_state && line_state->aborted )
+        return CMD_NORMAL;
 
     string command(origin_command);
+    bool line_start = !(line_state && line_state->continued);
+    if( line_start )
+        session_registry_count_line();
 
-    /* parsing */
-    OneLineCommand parsed_cmds;
-    parsed_cmds.parse_one_line_cmd(command);
-    parsed_cmds.print();
+    /* parsing, done already if lookahead planned this line */
+    RAS_PROBE1(line__start, origin_command);
+    PlannedLine plan;
+    OneLineCommand& parsed_cmds = plan.parsed;
+    if( !(line_start && cmd_lookahead.take(origin_command, plan)) &&
+      parsed_cmds.parse_one_line_cmd(command) == CMD_ERROR )
+        error_print_and_exit("%s\n", parsed_cmds.parse_error.c_str());
+    if( dump_parsed_cmds )
+        parsed_cmds.print();
+    if( plan.pid > 0 )
+        return commit_started_line(client_output, cmd_pipe_manager, plan, line_state);
 
     /* processing command */
     bool is_exit = false;
-    bool is_internal = is_internal_command_and_run(is_exit, parsed_cmds.cmds[0], client_socket);
+    bool is_internal = line_start && is_internal_command_and_run(is_exit, parsed_cmds.cmds[0], client_output);
+    if( line_state )
+        line_state->internal = is_internal || is_exit;
     if( is_exit ) return CMD_EXIT;
-    if( is_internal ) return CMD_NORMAL;
+    if( is_internal ){
+        /* setenv may change PATH or what later lines see */
+        cmd_lookahead.discard();
+        /* like a whole line, commands piped after an internal one are ignored */
+        if( line_state )
+            line_state->aborted = true;
+        RAS_PROBE2(line__end, 0, 0);
+        return CMD_NORMAL;
+    }
+    if( !resolve_person_redirection(client_output, parsed_cmds) ){
+        if( line_state )
+            line_state->aborted = true;
+        RAS_PROBE2(line__end, 0, 0);
+        return CMD_NORMAL;
+    }
+    if( parsed_cmds.background && !line_start ){
+        /* "&" came after the first pieces of the line had run */
+        const char refuse_msg[] = "Background line too long, its start already ran: rest not run.\n";
+        client_output.write(refuse_msg, strlen(refuse_msg));
+        /* output of the pieces that ran has no reader now */
+        if( cmd_pipe_manager.cmd_has_pipe(0) )
+            cmd_pipe_manager.get_pipe(0).close_pipe();
+        if( line_state )
+            line_state->aborted = true;
+        RAS_PROBE2(line__end, 0, 0);
+        return CMD_NORMAL;
+    }
+    if( parsed_cmds.background )
+        return start_background_job(client_output, cmd_pipe_manager, parsed_cmds, origin_command);
 
     // cmd_pipe_manager, parsed_cmds
     AnonyPipe child_output_pipe;
-    child_output_pipe.create_pipe();
+    cmd_pipe_manager.pipe_pool.acquire(child_output_pipe);
+    long output_size = 0;
     int legal_cmd = 0;
+    int stage_index = 0;
+    int last_status = 0;
 
     for( auto& current_cmd : parsed_cmds.cmds ){
         /* 
@@ -146,31 +525,56 @@ int execute_cmd(socketfd_t client_socket, PipeManager& cmd_pipe_manager, const c
         pre_fd_redirection(cmd_pipe_manager, STDIN_FILENO, current_cmd.std_input);
         pre_fd_redirection(cmd_pipe_manager, STDOUT_FILENO, current_cmd.std_output);
         pre_fd_redirection(cmd_pipe_manager, STDERR_FILENO, current_cmd.std_error);
+        if( current_cmd.std_output.kind == REDIR_FILE )
+            cmd_lookahead.file_written(current_cmd.std_output.data.filename);
         
-        int pid = fork();
+        admission_acquire_fork();
+        struct timespec stage_start;
+        clock_gettime(CLOCK_MONOTONIC, &stage_start);
+        int pid = -1;
+        bool by_spawner = false;
+        if( spawner_enabled() ){
+            pid = spawn_cmd_by_spawner(cmd_pipe_manager, current_cmd, child_output_pipe);
+            by_spawner = (pid > 0);
+        }
+        if( !by_spawner )
+            pid = fork();
         if( pid == 0 ){
-            /* stdin redirection */
-            fd_redirection(cmd_pipe_manager, STDIN_FILENO, current_cmd.std_input, child_output_pipe);
-            /* stdout redirection */
-            fd_redirection(cmd_pipe_manager, STDOUT_FILENO, current_cmd.std_output, child_output_pipe);
-            /* stderr redirection */
-            fd_redirection(cmd_pipe_manager, STDERR_FILENO, current_cmd.std_error, child_output_pipe);
-
-            char** argv = current_cmd.gen_argv();
-            execvp(current_cmd.executable.c_str(), argv);
-            /* exec error: print "Unknown command [command_name]" */
-            char unknown_cmd[MAX_CMD_SIZE+128] = "";
-            int u_cmd_size = snprintf(unknown_cmd, MAX_CMD_SIZE+128, "Unknown command: [%s].\n", current_cmd.executable.c_str());
-            write(child_output_pipe.write_fd(), unknown_cmd, u_cmd_size);
-            exit(EXIT_FAILURE);
+            exec_child(cmd_pipe_manager, current_cmd, child_output_pipe);
         }
         else if(pid > 0){
+            RAS_PROBE3(stage__fork, stage_index, pid, current_cmd.executable.c_str());
+            if( current_cmd.std_input.data.preopened_fd >= 0 ){
+                close(current_cmd.std_input.data.preopened_fd);
+                current_cmd.std_input.data.preopened_fd = -1;
+            }
             if( cmd_pipe_manager.cmd_has_pipe(0) ){
             /* if child stdin use pipe, close write end in parent. */
                 cmd_pipe_manager.get_pipe(0).close_write();
             }
+            if( current_cmd.std_output.is_fanout() ){
+                /* copy while the child runs, it could fill the pipe otherwise */
+                cmd_pipe_manager.fanout_source.close_write();
+                vector<int> targets = current_cmd.std_output.data.fanout_pipe_indexes;
+                targets.push_back(current_cmd.std_output.data.pipe_index_in_manager);
+                cmd_pipe_manager.fan_out(targets);
+            }
+            cmd_lookahead.plan_ahead();
+            if( current_cmd.std_output.kind == REDIR_NONE )
+                start_independent_lines(cmd_pipe_manager);
             int child_status;
-            wait(&child_status);
+            if( wait_stage_forwarding_output(pid, by_spawner, &child_status, child_output_pipe, client_output,
+              output_size) < 0 )
+                perror_and_exit("wait stage error");
+            admission_release_fork();
+            if( line_state ){
+                struct timespec stage_end;
+                clock_gettime(CLOCK_MONOTONIC, &stage_end);
+                line_state->stages.push_back(StageReport{child_status, elapsed_ms(stage_start, stage_end)});
+            }
+            RAS_PROBE4(stage__exit, stage_index, pid, child_status, current_cmd.executable.c_str());
+            stage_index += 1;
+            last_status = child_status;
             /* child status */
             if( WIFEXITED(child_status) ){
                 int exit_status = WEXITSTATUS(child_status); 
@@ -183,6 +587,8 @@ int execute_cmd(socketfd_t client_socket, PipeManager& cmd_pipe_manager, const c
                 }
                 else{
                     /* error cmd, finish this one-line-command */
+                    if( line_state )
+                        line_state->aborted = true;
                     break;
                 }
             }
@@ -191,27 +597,31 @@ int execute_cmd(socketfd_t client_socket, PipeManager& cmd_pipe_manager, const c
             perror_and_exit("fork error");
         }
     }
-    processing_child_output_data(child_output_pipe, client_socket);
-    child_output_pipe.close_pipe();
+    /* stages not run after a failed one */
+    close_preopened(parsed_cmds);
+    start_independent_lines(cmd_pipe_manager);
+    output_size += processing_child_output_data(child_output_pipe, client_output);
+    cmd_pipe_manager.pipe_pool.observe_traffic(output_size);
+    cmd_pipe_manager.pipe_pool.release(child_output_pipe);
+    RAS_PROBE2(line__end, stage_index, last_status);
 
     return CMD_NORMAL;
 }
 
 /* ras_service sub functions */
 void ras_shell_init(){
-    char ras_dir[1024+1];
-    char* home_dir = getenv("HOME");
-    if(!home_dir)
-        error_print_and_exit("Error: No HOME enviroment variable\n");
+    /* $HOME/ras, --root, or a fresh copy of --root-template */
+    session_root_enter();
 
-    snprintf(ras_dir, 1024, "%s/ras/", home_dir);
-    int ret = chdir(ras_dir);
-    if(ret == -1)
-        perror_and_exit("chdir error");
+    /* drop setenv of previous session */
+    clearenv();
+    for( const auto& env : initial_environ )
+        putenv(const_cast<char*>(env.c_str()));
 
-    ret = setenv("PATH", "bin:.", 1);
+    int ret = setenv("PATH", "bin:.", 1);
     if(ret == -1)
         perror_and_exit("setenv error");
+    placement_export_env();
 }
 
 void print_welcome_msg(socketfd_t client_socket){
@@ -266,18 +676,32 @@ void print_welcome_msg(socketfd_t client_socket){
     */
 }
 
-int read_cmd_from_socket_and_check_overflow(char* cmd_buf, int& cmd_size, socketfd_t client_socket){
-    /* return read size */
-    if(cmd_size == MAX_ONELINE_CMD_SIZE){
-        /* command too long */
-        const char err_msg[] = "command too long.\n";
-        write_all(client_socket, err_msg, strlen(err_msg));
-        error_print(err_msg);
-        cmd_size = 0;
-    }
-        
+int read_cmd_from_socket_and_check_overflow(char* cmd_buf, int& cmd_size, socketfd_t client_socket,
+  SessionOutput& client_output, bool prompt){
+    /* write the prompt, return read size. with the ring the prompt
+     * and the read are one submission */
+    const char prompt_str[] = "% ";
+    bool overflow = (cmd_size == tunables.max_line_size);
     int recv_size = 0;
-    recv_size = read(client_socket, cmd_buf+cmd_size, MAX_ONELINE_CMD_SIZE-cmd_size);
+    if( !overflow && uring_can_send(client_output) ){
+        recv_size = uring_prompt_and_read(prompt ? prompt_str : NULL, strlen(prompt_str), cmd_buf+cmd_size,
+          tunables.max_line_size-cmd_size);
+    }
+    else{
+        if( prompt )
+            client_output.write(prompt_str, strlen(prompt_str));
+        client_output.flush();
+        if( client_output.drain_until_readable(client_socket) < 0 )
+            perror_and_exit("client output error");
+        if( overflow ){
+            /* command too long */
+            const char err_msg[] = "command too long.\n";
+            client_output.write(err_msg, strlen(err_msg));
+            error_print(err_msg);
+            cmd_size = 0;
+        }
+        recv_size = read(client_socket, cmd_buf+cmd_size, tunables.max_line_size-cmd_size);
+    }
     if( recv_size == 0 ){
         /* client is closing connection */
         return recv_size;
@@ -287,22 +711,204 @@ int read_cmd_from_socket_and_check_overflow(char* cmd_buf, int& cmd_size, socket
     }
     cmd_size += recv_size; 
     cmd_buf[cmd_size] = '\0';
+    RAS_PROBE2(cmd__read, recv_size, cmd_size);
     return recv_size;
 }
 
+int execute_line_pieces(SessionOutput& client_output, PipeManager& cmd_pipe_manager, char*& cmd_head,
+  LineState& line_state, bool line_complete){
+    /* run a long (maybe unfinished) line in pieces of at most RAS_STREAM_WINDOW bytes,
+     * each ending with a pipe. output of a piece is forwarded before the next one is
+     * parsed, parsing stays linear in the line length. cmd_head moves to what is left.
+     * a complete line ending with "&" is not split, it runs whole as a job. */
+    if( line_complete && !line_state.continued && strlen(cmd_head) >= RAS_STREAM_WINDOW &&
+      background_mark(cmd_head) != string::npos )
+        return CMD_NORMAL;
+    while( !line_state.aborted && strlen(cmd_head) >= RAS_STREAM_WINDOW ){
+        char window_end_char = cmd_head[RAS_STREAM_WINDOW];
+        cmd_head[RAS_STREAM_WINDOW] = '\0';
+        char* split = find_stream_split(cmd_head);
+        cmd_head[RAS_STREAM_WINDOW] = window_end_char;
+        if( !split )
+            /* one command longer than the window, runs with its line */
+            break;
+
+        char split_char = split[0];
+        split[0] = '\0';
+        int status = execute_cmd(client_output, cmd_pipe_manager, cmd_head, &line_state);
+        split[0] = split_char;
+        line_state.continued = true;
+        cmd_head = split;
+        cmd_pipe_manager.compact();
+        if( status == CMD_EXIT )
+            return CMD_EXIT;
+    }
+    return CMD_NORMAL;
+}
+
+int execute_lines(SessionOutput& client_output, PipeManager& cmd_pipe_manager, char*& cmd_head,
+  LineState& line_state){
+    /* run every complete line from cmd_head, and the complete pieces of an unfinished
+     * one. stops after a line switching to framed protocol. cmd_head moves past what was run. */
+    char* newline_char;
+    while( (newline_char = strchr(cmd_head, '\n')) != NULL ){
+        /* split command and execute it. */
+        newline_char[0] = '\0';
+        recorder_append(RECORD_LINE, cmd_head, newline_char - cmd_head);
+        struct timespec line_start;
+        clock_gettime(CLOCK_MONOTONIC, &line_start);
+        int status = execute_line_pieces(client_output, cmd_pipe_manager, cmd_head, line_state);
+        cmd_lookahead.set_queue(newline_char+1, NULL, false);
+        if( status != CMD_EXIT )
+            status = execute_cmd(client_output, cmd_pipe_manager, cmd_head, &line_state);
+        cmd_lookahead.set_queue(NULL, NULL, false);
+        cmd_head = newline_char+1;
+        if( client_output.framed ){
+            /* answered as request 0, client reads frames from here on */
+            write_status_frame(client_output, line_state, line_start, status);
+            line_state = LineState{};
+            return status;
+        }
+        line_state = LineState{};
+        if( status == CMD_EXIT )
+            return CMD_EXIT;
+    }
+
+    /* long line still arriving: start what is complete, memory stays
+     * bounded by cmd_buf instead of the line length */
+    char* piece_head = cmd_head;
+    int status = CMD_NORMAL;
+    if( line_state.aborted )
+        cmd_head += strlen(cmd_head);
+    else
+        status = execute_line_pieces(client_output, cmd_pipe_manager, cmd_head, line_state, false);
+    if( cmd_head != piece_head )
+        recorder_append(RECORD_PIECE, piece_head, cmd_head - piece_head);
+    return status;
+}
+
+int execute_frames(SessionOutput& client_output, PipeManager& cmd_pipe_manager, char*& cmd_head,
+  char* cmd_end){
+    /* run every complete FRAME_REQUEST in [cmd_head, cmd_end) in order, each answered
+     * by its output and a FRAME_STATUS. stops after a request switching back to text.
+     * cmd_head moves past what was run. */
+    while( client_output.framed && cmd_end - cmd_head >= FRAME_HEADER_SIZE ){
+        uint32_t length = frame_get_u32(cmd_head);
+        if( cmd_head[4] != FRAME_REQUEST || length > (uint32_t)(tunables.max_line_size - FRAME_HEADER_SIZE) ){
+            error_print("bad request frame, type %d, length %u\n", cmd_head[4], length);
+            return CMD_EXIT;
+        }
+        if( cmd_end - cmd_head < FRAME_HEADER_SIZE + (long)length )
+            break;
+
+        char* line = cmd_head + FRAME_HEADER_SIZE;
+        char* line_end = line + length;
+        char next_frame_char = line_end[0];
+        line_end[0] = '\0';
+        recorder_append(RECORD_LINE, line, length);
+
+        LineState line_state = {};
+        struct timespec line_start;
+        clock_gettime(CLOCK_MONOTONIC, &line_start);
+        int status = execute_line_pieces(client_output, cmd_pipe_manager, line, line_state);
+        cmd_lookahead.set_queue(line_end, cmd_end, true);
+        if( status != CMD_EXIT )
+            status = execute_cmd(client_output, cmd_pipe_manager, line, &line_state);
+        cmd_lookahead.set_queue(NULL, NULL, false);
+        line_end[0] = next_frame_char;
+        cmd_head = line_end;
+
+        write_status_frame(client_output, line_state, line_start, status);
+        if( status == CMD_EXIT )
+            return CMD_EXIT;
+    }
+    return CMD_NORMAL;
+}
+
+void write_status_frame(SessionOutput& client_output, const LineState& line_state,
+  const struct timespec& line_start, int status){
+    struct timespec line_end;
+    clock_gettime(CLOCK_MONOTONIC, &line_end);
+    int flags = 0;
+    if( line_state.internal )
+        flags |= FRAME_STATUS_INTERNAL;
+    else if( line_state.aborted )
+        flags |= FRAME_STATUS_ABORTED;
+    if( status == CMD_EXIT )
+        flags |= FRAME_STATUS_EXIT;
+
+    vector<char> payload(FRAME_STATUS_FIXED_SIZE + FRAME_STAGE_SIZE * line_state.stages.size());
+    frame_put_u32(&payload[0], client_output.frame_seq);
+    frame_put_u32(&payload[4], line_state.stages.size());
+    frame_put_u64(&payload[8], (uint64_t)(elapsed_ms(line_start, line_end) * 1000));
+    char* stage_buf = &payload[FRAME_STATUS_FIXED_SIZE];
+    for( const auto& stage : line_state.stages ){
+        frame_put_u32(stage_buf, stage.wait_status);
+        frame_put_u32(stage_buf + 4, (uint32_t)(stage.elapsed_ms * 1000));
+        stage_buf += FRAME_STAGE_SIZE;
+    }
+    client_output.write_frame(FRAME_STATUS, flags, payload.data(), payload.size());
+}
+
+char* find_stream_split(char* cmd_head){
+    /* return end of the last complete "|" or "|N" token, NULL if none.
+     * a token right at the end may still grow ("|1" of "|12"), skip it.
+     * so is one followed by more fan-out targets (",5" or " |5"), or by
+     * nothing but whitespace yet. */
+    char* split = NULL;
+    for( char* pipe_char = strchr(cmd_head, '|'); pipe_char; pipe_char = strchr(pipe_char+1, '|') ){
+        char* token_end = pipe_char+1;
+        while( isdigit(*token_end) || (*token_end == ',' && isdigit(token_end[1])) )
+            token_end++;
+        if( *token_end == '\0' || !strchr(WHITESPACE, *token_end) )
+            continue;
+        char* next_word = token_end + strspn(token_end, WHITESPACE);
+        if( *next_word == '\0' || (*next_word == '|' && isdigit(next_word[1])) )
+            continue;
+        split = token_end;
+    }
+    return split;
+}
+
+/* ras_batch sub functions */
+double elapsed_ms(const struct timespec& start, const struct timespec& end){
+    return (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+double timeval_ms(const struct timeval& tv){
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
 /* execute_cmd sub functions */
 void pre_fd_redirection(PipeManager& cmd_pipe_manager, int origin_fd, Redirection& redirect_obj){
-    /* create pipe */
+    /* create pipe, or rewind file backed pipe for its consumer */
+    RAS_PROBE3(redirect, origin_fd, redirect_obj.kind,
+      redirect_obj.kind == REDIR_PIPE ? redirect_obj.data.pipe_index_in_manager : -1);
     if( redirect_obj.kind == REDIR_PIPE ){
-        if( origin_fd == STDOUT_FILENO || origin_fd == STDERR_FILENO ){
-            int pipe_index = redirect_obj.data.pipe_index_in_manager;
-            AnonyPipe& redirect_pipe = cmd_pipe_manager.get_pipe(pipe_index);
-            if( !redirect_pipe.enable )
-                redirect_pipe.create_pipe();
+        int pipe_index = redirect_obj.data.pipe_index_in_manager;
+        AnonyPipe& redirect_pipe = cmd_pipe_manager.get_pipe(pipe_index);
+        if( origin_fd == STDIN_FILENO ){
+            redirect_pipe.prepare_read();
+            cmd_pipe_manager.pipe_pool.observe_traffic(redirect_pipe.unread_bytes());
+        }
+        else if( origin_fd == STDOUT_FILENO || origin_fd == STDERR_FILENO ){
+            prepare_output_pipe(cmd_pipe_manager, pipe_index);
+            if( redirect_obj.is_fanout() ){
+                /* child writes one pipe, parent copies it to every target */
+                for( int fanout_index : redirect_obj.data.fanout_pipe_indexes )
+                    prepare_output_pipe(cmd_pipe_manager, fanout_index);
+                cmd_pipe_manager.pipe_pool.acquire(cmd_pipe_manager.fanout_source);
+            }
         }
     }
 }
 
+void prepare_output_pipe(PipeManager& cmd_pipe_manager, int pipe_index){
+    AnonyPipe& redirect_pipe = cmd_pipe_manager.get_pipe(pipe_index);
+    if( !redirect_pipe.enable )
+        redirect_pipe.create_pipe(PIPE_BACKING_FILE);
+}
+
 void fd_redirection(PipeManager& cmd_pipe_manager, int origin_fd, Redirection& redirect_obj,
   AnonyPipe& child_output_pipe){
     /* do the STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO redirection */
@@ -314,7 +920,9 @@ void fd_redirection(PipeManager& cmd_pipe_manager, int origin_fd, Redirection& r
     }
     else if( redirect_obj.kind == REDIR_FILE ){
         int file_fd;
-        if( origin_fd == STDIN_FILENO )
+        if( origin_fd == STDIN_FILENO && redirect_obj.data.preopened_fd >= 0 )
+            file_fd = redirect_obj.data.preopened_fd;
+        else if( origin_fd == STDIN_FILENO )
             file_fd = open(redirect_obj.data.filename.c_str(), O_RDONLY);
         else
             file_fd = open(redirect_obj.data.filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
@@ -334,26 +942,288 @@ void fd_redirection(PipeManager& cmd_pipe_manager, int origin_fd, Redirection& r
             redirect_pipe.close_pipe();
         }
         else if( origin_fd == STDOUT_FILENO || origin_fd == STDERR_FILENO ){
-            int redirect_fd = redirect_pipe.write_fd();
+            int redirect_fd = redirect_obj.is_fanout() ? cmd_pipe_manager.fanout_source.write_fd()
+                                                       : redirect_pipe.write_fd();
             dup2(redirect_fd, origin_fd);
         }
     }
 }
 
-bool is_internal_command_and_run(bool& is_exit, SingleCommand& cmd, socketfd_t client_socket){
+void exec_child(PipeManager& cmd_pipe_manager, SingleCommand& cmd, AnonyPipe& child_output_pipe){
+    /* forked child of one stage, never returns */
+    /* stdin redirection */
+    fd_redirection(cmd_pipe_manager, STDIN_FILENO, cmd.std_input, child_output_pipe);
+    /* stdout redirection */
+    fd_redirection(cmd_pipe_manager, STDOUT_FILENO, cmd.std_output, child_output_pipe);
+    /* stderr redirection */
+    fd_redirection(cmd_pipe_manager, STDERR_FILENO, cmd.std_error, child_output_pipe);
+
+    char** argv = cmd.gen_argv();
+    /* the session ignores SIGUSR2 and SIGPIPE, the command must not inherit them */
+    signal(SIGUSR2, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    sched_apply_env();
+    if( !cmd.exec_path.empty() )
+        execv(cmd.exec_path.c_str(), argv);
+    execvp(cmd.executable.c_str(), argv);
+    /* exec error: print "Unknown command [command_name]" */
+    vector<char> unknown_cmd(tunables.max_cmd_size+128);
+    int u_cmd_size = snprintf(unknown_cmd.data(), unknown_cmd.size(), "Unknown command: [%s].\n", cmd.executable.c_str());
+    write(child_output_pipe.write_fd(), unknown_cmd.data(), min(u_cmd_size, (int)unknown_cmd.size()-1));
+    /* exit() would flush server's stdio buffers into the client output */
+    _exit(EXIT_FAILURE);
+}
+
+void start_independent_lines(PipeManager& cmd_pipe_manager){
+    /* start planned lines out of order, front first, up to the first one which is
+     * not independent. with a pipe into any command ahead, lines may shift onto it.
+     * opt-in: that a command changes nothing but its output is not checked. */
+    if( !run_ahead_enabled || cmd_pipe_manager.has_pending_pipes() )
+        return;
+    for( auto& plan : cmd_lookahead.planned ){
+        if( plan.pid > 0 )
+            continue;
+        if( !runs_independently(plan.parsed) )
+            return;
+
+        SingleCommand& cmd = plan.parsed.cmds[0];
+        plan.output.create_pipe(PIPE_BACKING_FILE);
+        admission_acquire_fork();
+        clock_gettime(CLOCK_MONOTONIC, &plan.start);
+        int pid = -1;
+        plan.by_spawner = false;
+        if( spawner_enabled() ){
+            pid = spawn_cmd_by_spawner(cmd_pipe_manager, cmd, plan.output);
+            plan.by_spawner = (pid > 0);
+        }
+        if( !plan.by_spawner )
+            pid = fork();
+        if( pid == 0 )
+            exec_child(cmd_pipe_manager, cmd, plan.output);
+        if( pid < 0 )
+            perror_and_exit("fork error");
+
+        RAS_PROBE3(stage__fork, 0, pid, cmd.executable.c_str());
+        close_preopened(plan.parsed);
+        plan.pid = pid;
+        cmd_lookahead.stats.started += 1;
+    }
+}
+
+int commit_started_line(SessionOutput& client_output, PipeManager& cmd_pipe_manager, PlannedLine& plan,
+  LineState* line_state){
+    /* line started by start_independent_lines, now in its turn: keep the lines
+     * behind it going, then account for it as if it had run just now */
+    SingleCommand& cmd = plan.parsed.cmds[0];
+    int pid = plan.pid;
+    cmd_lookahead.plan_ahead();
+    start_independent_lines(cmd_pipe_manager);
+
+    int child_status;
+    if( wait_started_line(plan, &child_status) < 0 )
+        perror_and_exit("wait started line error");
+    if( line_state ){
+        struct timespec stage_end;
+        clock_gettime(CLOCK_MONOTONIC, &stage_end);
+        line_state->stages.push_back(StageReport{child_status, elapsed_ms(plan.start, stage_end)});
+    }
+    RAS_PROBE4(stage__exit, 0, pid, child_status, cmd.executable.c_str());
+    if( WIFEXITED(child_status) ){
+        if( WEXITSTATUS(child_status) == 0 ){
+            cmd_pipe_manager.get_pipe(0).close_pipe();
+            cmd_pipe_manager.next_pipe();
+        }
+        else if( line_state ){
+            line_state->aborted = true;
+        }
+    }
+
+    long output_size = lseek(plan.output.write_fd(), 0, SEEK_END);
+    if( output_size > 0 && client_output.forward_from_file(plan.output.read_fd(), output_size) < 0 )
+        perror_and_exit("forward child output error");
+    plan.output.close_pipe();
+    RAS_PROBE2(line__end, 1, child_status);
+    return CMD_NORMAL;
+}
+
+int start_background_job(SessionOutput& client_output, PipeManager& cmd_pipe_manager, OneLineCommand& parsed_cmds,
+  const char* origin_command){
+    /* fork the job runner of a line ending with "&", tell the client its number */
+    const char* refuse_msg = NULL;
+    if( session_jobs.jobs.size() >= (size_t)JOBS_MAX )
+        refuse_msg = "Too many jobs.\n";
+    else if( cmd_pipe_manager.has_pending_pipes() || !line_is_self_contained(parsed_cmds) )
+        refuse_msg = "Background line can not use numbered pipes of other lines.\n";
+    if( refuse_msg ){
+        client_output.write(refuse_msg, strlen(refuse_msg));
+        close_preopened(parsed_cmds);
+        return CMD_NORMAL;
+    }
+
+    string text(origin_command);
+    text.erase(text.find_last_of('&'));
+    text.erase(text.find_last_not_of(WHITESPACE) + 1);
+    for( const auto& cmd : parsed_cmds.cmds ){
+        if( cmd.std_output.kind == REDIR_FILE )
+            cmd_lookahead.file_written(cmd.std_output.data.filename);
+    }
+
+    AnonyPipe job_output_pipe;
+    job_output_pipe.create_pipe(PIPE_BACKING_FILE);
+    pid_t session_pid = getpid();
+    int pid = fork();
+    if( pid == 0 ){
+        setpgid(0, 0);
+        run_background_job(client_output, cmd_pipe_manager, text, job_output_pipe, session_pid);
+    }
+    if( pid < 0 )
+        perror_and_exit("fork error");
+    /* here too, kill_all may signal the group before the runner ran */
+    setpgid(pid, pid);
+    close_preopened(parsed_cmds);
+
+    Job* job = session_jobs.add(pid, text, job_output_pipe);
+    char started_msg[64];
+    int size = snprintf(started_msg, sizeof(started_msg), "[%d] %d\n", job->id, pid);
+    client_output.write(started_msg, size);
+    RAS_PROBE2(line__end, 0, 0);
+    return CMD_NORMAL;
+}
+
+void run_background_job(SessionOutput& client_output, PipeManager& cmd_pipe_manager, const string& text,
+  AnonyPipe& job_output_pipe, pid_t session_pid){
+    /* forked job runner, never returns. drop what belongs to the session: a held
+     * pooled pipe would keep a later reader from seeing EOF, a shared spawner
+     * channel would mix up replies. then run the line into the job output. */
+    if( client_output.is_socket )
+        close(client_output.fd);
+    spawner_session_disconnect();
+    uring_session_forget();
+    cmd_pipe_manager.pipe_pool.trim();
+    cmd_lookahead.forget();
+    session_jobs.forget();
+    session_registry_forget();
+    /* a session killed, or ended by an error, takes its jobs along as kill_all would */
+    signal(SIGTERM, job_runner_terminated);
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    if( getppid() != session_pid )
+        job_runner_terminated(SIGTERM);
+
+    SessionOutput job_output(job_output_pipe.write_fd());
+    job_output.forward_chunk = tunables.forward_chunk;
+    LineState line_state = {};
+    execute_cmd(job_output, cmd_pipe_manager, text.c_str(), &line_state);
+    job_output.flush();
+
+    /* exit code of the stage that stopped the line */
+    int exit_code = 0;
+    if( line_state.aborted && !line_state.stages.empty() && WIFEXITED(line_state.stages.back().wait_status) )
+        exit_code = WEXITSTATUS(line_state.stages.back().wait_status);
+    _exit(exit_code);
+}
+
+void job_runner_terminated(int sig){
+    /* the stages of the job are in the group of the runner */
+    signal(sig, SIG_DFL);
+    kill(0, sig);
+}
+
+int spawn_cmd_by_spawner(PipeManager& cmd_pipe_manager, SingleCommand& cmd, AnonyPipe& child_output_pipe){
+    /* resolve redirections to fds here, spawner forks and execs with them.
+     * return pid, -1 to fall back to fork in this process. */
+    int fds[SPAWNER_FD_COUNT];
+    bool is_opened[3];
+    fds[0] = redirection_fd(cmd_pipe_manager, STDIN_FILENO, cmd.std_input, child_output_pipe, is_opened[0]);
+    fds[1] = redirection_fd(cmd_pipe_manager, STDOUT_FILENO, cmd.std_output, child_output_pipe, is_opened[1]);
+    fds[2] = redirection_fd(cmd_pipe_manager, STDERR_FILENO, cmd.std_error, child_output_pipe, is_opened[2]);
+    fds[3] = child_output_pipe.write_fd();
+
+    int pid = -1;
+    if( fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 ){
+        char** argv = cmd.gen_argv();
+        pid = spawner_spawn(argv, fds);
+        cmd.free_argv(argv);
+    }
+
+    for( int i=0; i<3; i++ ){
+        if( is_opened[i] && fds[i] >= 0 )
+            close(fds[i]);
+    }
+    return pid;
+}
+
+int redirection_fd(PipeManager& cmd_pipe_manager, int origin_fd, Redirection& redirect_obj,
+  AnonyPipe& child_output_pipe, bool& is_opened){
+    /* same choice as fd_redirection, return the fd instead of dup2 it */
+    is_opened = false;
+    if( redirect_obj.kind == REDIR_NONE ){
+        if( origin_fd == STDOUT_FILENO || origin_fd == STDERR_FILENO )
+            return child_output_pipe.write_fd();
+    }
+    else if( redirect_obj.kind == REDIR_FILE ){
+        is_opened = true;
+        if( origin_fd == STDIN_FILENO && redirect_obj.data.preopened_fd >= 0 ){
+            /* closed by the caller after the spawn, fork fallback opens again */
+            int file_fd = redirect_obj.data.preopened_fd;
+            redirect_obj.data.preopened_fd = -1;
+            return file_fd;
+        }
+        if( origin_fd == STDIN_FILENO )
+            return open(redirect_obj.data.filename.c_str(), O_RDONLY|O_CLOEXEC);
+        else
+            return open(redirect_obj.data.filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    }
+    else if( redirect_obj.kind == REDIR_PIPE ){
+        int pipe_index = redirect_obj.data.pipe_index_in_manager;
+        AnonyPipe& redirect_pipe = cmd_pipe_manager.get_pipe(pipe_index);
+        if( origin_fd == STDIN_FILENO )
+            return redirect_pipe.read_fd();
+        else if( redirect_obj.is_fanout() )
+            return cmd_pipe_manager.fanout_source.write_fd();
+        else
+            return redirect_pipe.write_fd();
+    }
+    return origin_fd;
+}
+
+bool is_internal_command_and_run(bool& is_exit, SingleCommand& cmd, SessionOutput& client_output){
     if( cmd.executable == "exit" ){
         is_exit = true;
     }
+    else if( is_job_command_and_run(cmd, client_output) ){
+        return true;
+    }
+    else if( cmd.executable == "who" ){
+        session_registry_list(client_output);
+    }
     else if( cmd.executable == "printenv" ){
         char tmp[1024+1];
         const char* argv1 = cmd.arguments[1].c_str();
         int size = snprintf(tmp, 1024, "%s=%s\n", argv1, getenv(argv1));
-        write_all(client_socket, tmp, size);
+        client_output.write(tmp, size);
     }
     else if( cmd.executable == "setenv" ){
         const char* argv1 = cmd.arguments[1].c_str();
         const char* argv2 = cmd.arguments[2].c_str();
+        if( !sched_env_valid(argv1, argv2) ){
+            char tmp[1024+1];
+            int size = snprintf(tmp, 1024, "Invalid %s: [%s].\n", argv1, argv2);
+            client_output.write(tmp, size);
+            return true;
+        }
         setenv(argv1, argv2, 1);
+        if( strcmp(argv1, "RAS_COMPRESS") == 0 && client_output.set_compression(argv2) == -1 ){
+            char tmp[1024+1];
+            int size = snprintf(tmp, 1024, "Unknown compression: [%s].\n", argv2);
+            client_output.write(tmp, size);
+        }
+        if( strcmp(argv1, "RAS_PROTOCOL") == 0 && client_output.set_protocol(argv2) == -1 ){
+            char tmp[1024+1];
+            int size = snprintf(tmp, 1024, "Unknown protocol: [%s].\n", argv2);
+            client_output.write(tmp, size);
+        }
     }
     else{
         return false;
@@ -361,19 +1231,155 @@ bool is_internal_command_and_run(bool& is_exit, SingleCommand& cmd, socketfd_t c
     return true;
 }
 
-void processing_child_output_data(AnonyPipe& child_output_pipe, socketfd_t client_socket){
-    child_output_pipe.close_write();
-    while(1){
-        char* read_buf[1024+1];
-        int read_size = read(child_output_pipe.read_fd(), read_buf, 1024);
-        if(read_size == 0){
-            break; 
+bool is_job_command_and_run(SingleCommand& cmd, SessionOutput& client_output){
+    /* jobs, wait [n], fg [n]. n is "2" or "%2" */
+    if( cmd.executable != "jobs" && cmd.executable != "wait" && cmd.executable != "fg" )
+        return false;
+    if( cmd.executable == "jobs" ){
+        session_jobs.list(client_output);
+        return true;
+    }
+
+    Job* job = NULL;
+    if( cmd.args_count > 1 ){
+        int id = parse_job_id(cmd.arguments[1]);
+        job = (id > 0) ? session_jobs.find(id) : NULL;
+        if( !job ){
+            char tmp[1024+1];
+            int size = snprintf(tmp, 1024, "No such job: [%s].\n", cmd.arguments[1].c_str());
+            client_output.write(tmp, size);
+            return true;
         }
-        else if(read_size < 0){
-            perror_and_exit("read child pipe error");
+    }
+    else if( cmd.executable == "fg" ){
+        job = session_jobs.last();
+        if( !job ){
+            const char no_job_msg[] = "No current job.\n";
+            client_output.write(no_job_msg, strlen(no_job_msg));
+            return true;
         }
-        else{
-            int write_size = write_all(client_socket, read_buf, read_size);
+    }
+
+    if( !job ){
+        /* plain wait: every job, announced as it would be at the prompt */
+        for( auto& each_job : session_jobs.jobs ){
+            if( session_jobs.wait_job(each_job) < 0 )
+                perror_and_exit("wait job error");
+        }
+        session_jobs.report_finished(client_output);
+        return true;
+    }
+    if( session_jobs.wait_job(*job) < 0 )
+        perror_and_exit("wait job error");
+    session_jobs.report(*job, client_output, cmd.executable == "fg");
+    return true;
+}
+
+bool resolve_person_redirection(SessionOutput& client_output, OneLineCommand& parsed_cmds){
+    /* "<n" and ">n" name session n of the registry, false drops the line.
+     * output is not carried between sessions yet, so once n is found both
+     * are refused: "<n" has nothing to read, ">n" could not be delivered */
+    for( auto& cmd : parsed_cmds.cmds ){
+        Redirection* person_redirects[2] = {&cmd.std_input, &cmd.std_output};
+        for( Redirection* redirect_obj : person_redirects ){
+            if( redirect_obj->kind != REDIR_TO_PERSON )
+                continue;
+            int person_id = redirect_obj->data.person_id;
+            SessionInfo person;
+            char tmp[1024+1];
+            int size;
+            if( !session_registry_lookup(person_id, person) )
+                size = snprintf(tmp, 1024, "*** Error: user #%d does not exist yet. ***\n", person_id);
+            else if( redirect_obj == &cmd.std_input )
+                size = snprintf(tmp, 1024, "*** Error: the pipe #%d->#%d does not exist yet. ***\n",
+                  person_id, session_registry_self());
+            else
+                size = snprintf(tmp, 1024, "*** Error: the pipe #%d->#%d can not be delivered yet. ***\n",
+                  session_registry_self(), person_id);
+            client_output.write(tmp, size);
+            return false;
         }
     }
+    return true;
+}
+
+long processing_child_output_data(AnonyPipe& child_output_pipe, SessionOutput& client_output){
+    /* all children were waited, so forward what is left in the pipe and
+     * keep both ends open for the pipe pool. return forwarded size. */
+    long ring_size = 0;
+    if( uring_enabled() && (ring_size = uring_stop_pipe_read()) < 0 )
+        perror_and_exit("forward child output error");
+    int unread_size = child_output_pipe.unread_bytes();
+    if( unread_size == 0 )
+        return ring_size;
+
+    long forwarded_size = client_output.forward_from_pipe(child_output_pipe.read_fd(), unread_size);
+    if( forwarded_size < 0 )
+        perror_and_exit("forward child output error");
+    RAS_PROBE1(output__forward, forwarded_size);
+    return ring_size + forwarded_size;
+}
+
+int wait_stage_forwarding_output(int pid, bool by_spawner, int* child_status, AnonyPipe& child_output_pipe,
+  SessionOutput& client_output, long& output_size){
+    /* like waitpid(pid, child_status, 0), forwarding the line output while the stage
+     * runs: a stage writing more than the pipe holds would never exit otherwise.
+     * over the pending budget the pipe is not read, the stage blocks on it until
+     * the client reads. with the ring, uring_wait_stage does all this. return -1 for error. */
+    if( !by_spawner && uring_enabled() )
+        return uring_wait_stage(pid, child_status, child_output_pipe.read_fd(), output_size);
+    int exit_fd = by_spawner ? spawner_wait_fd() : open_exit_fd(pid);
+    int ret;
+    while( (ret = by_spawner ? spawner_try_wait(pid, child_status) : waitpid(pid, child_status, WNOHANG)) <= 0 ){
+        if( ret < 0 && errno != EINTR )
+            break;
+        if( client_output.pending_bytes() >= SESSION_OUTPUT_BUDGET ){
+            if( client_output.wait_writable() < 0 || client_output.drain_pending() < 0 ){
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+
+        struct pollfd poll_fds[3];
+        int poll_count = 0;
+        poll_fds[poll_count++] = {child_output_pipe.read_fd(), POLLIN, 0};
+        if( client_output.pending_bytes() > 0 )
+            poll_fds[poll_count++] = {client_output.fd, POLLOUT, 0};
+        if( exit_fd >= 0 )
+            poll_fds[poll_count++] = {exit_fd, POLLIN, 0};
+        if( poll(poll_fds, poll_count, exit_fd >= 0 ? -1 : RAS_STAGE_POLL_MS) < 0 && errno != EINTR ){
+            ret = -1;
+            break;
+        }
+
+        if( client_output.pending_bytes() > 0 && client_output.drain_pending() < 0 ){
+            ret = -1;
+            break;
+        }
+        long unread_size = child_output_pipe.unread_bytes();
+        long room_size = SESSION_OUTPUT_BUDGET - client_output.pending_bytes();
+        if( unread_size > 0 && room_size > 0 ){
+            long forwarded_size = client_output.forward_from_pipe(child_output_pipe.read_fd(),
+              min(unread_size, room_size));
+            if( forwarded_size < 0 ){
+                ret = -1;
+                break;
+            }
+            RAS_PROBE1(output__forward, forwarded_size);
+            output_size += forwarded_size;
+        }
+    }
+    if( !by_spawner && exit_fd >= 0 )
+        close(exit_fd);
+    return ret < 0 ? -1 : 0;
+}
+
+int open_exit_fd(int pid){
+    /* pidfd, readable once pid exits. -1 without kernel support, callers poll instead */
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    return -1;
+#endif
 }
@@ -0,0 +1,105 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "recorder.h"
+#include "io_wrapper.h"
+
+using namespace std;
+
+static RecorderFileHeader* recorder_file = NULL; /* NULL when recording is off */
+static uint32_t recorder_session_id = 0;         /* id of this session process */
+
+/* recorder sub functions */
+uint32_t record_size(uint32_t data_len){
+    uint32_t size = sizeof(RecordHeader) + data_len;
+    return (size + RECORDER_ALIGN - 1) & ~(RECORDER_ALIGN - 1);
+}
+
+uint64_t realtime_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* recorder */
+void recorder_open(const char* path){
+    /* appends to an existing log, an upgraded server keeps recording into it */
+    int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+    if( fd < 0 )
+        perror_and_exit("open record file error");
+
+    struct stat file_stat;
+    if( fstat(fd, &file_stat) < 0 )
+        perror_and_exit("stat record file error");
+    bool is_new = (file_stat.st_size == 0);
+    uint64_t capacity = is_new ? RECORDER_CAPACITY : file_stat.st_size;
+    if( is_new && ftruncate(fd, capacity) < 0 )
+        perror_and_exit("truncate record file error");
+    if( capacity < RECORDER_DATA_OFFSET )
+        error_print_and_exit("record file %s is not a ras record\n", path);
+
+    /* shared with every forked session */
+    void* mem = mmap(NULL, capacity, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if( mem == MAP_FAILED )
+        perror_and_exit("mmap record file error");
+    close(fd);
+
+    if( is_new ){
+        recorder_file = new (mem) RecorderFileHeader;
+        memcpy(recorder_file->magic, RECORDER_MAGIC, sizeof(RECORDER_MAGIC));
+        recorder_file->capacity = capacity;
+        recorder_file->tail.store(RECORDER_DATA_OFFSET);
+        recorder_file->dropped.store(0);
+        recorder_file->next_session_id.store(1);
+    }
+    else{
+        recorder_file = (RecorderFileHeader*)mem;
+        if( memcmp(recorder_file->magic, RECORDER_MAGIC, sizeof(RECORDER_MAGIC)) != 0 ||
+          recorder_file->capacity != capacity )
+            error_print_and_exit("record file %s is not a ras record\n", path);
+    }
+    error_print("recording to %s, %lu of %lu bytes used\n", path,
+      (unsigned long)recorder_file->tail.load(), (unsigned long)capacity);
+}
+
+bool recorder_enabled(){
+    return recorder_file != NULL;
+}
+
+void recorder_session_start(){
+    if( !recorder_file )
+        return;
+    recorder_session_id = recorder_file->next_session_id.fetch_add(1);
+    recorder_append(RECORD_OPEN, NULL, 0);
+}
+
+void recorder_append(RecordKind kind, const char* data, uint32_t data_len){
+    if( !recorder_file )
+        return;
+
+    uint32_t size = record_size(data_len);
+    uint64_t offset = recorder_file->tail.fetch_add(size);
+    if( offset + size > recorder_file->capacity ){
+        /* tail stays past the end, later records are dropped too */
+        recorder_file->dropped.fetch_add(1);
+        return;
+    }
+
+    RecordHeader* record = (RecordHeader*)((char*)recorder_file + offset);
+    record->kind = kind;
+    record->reserved = 0;
+    record->session_id = recorder_session_id;
+    record->data_len = data_len;
+    record->timestamp_ns = realtime_ns();
+    if( data_len > 0 )
+        memcpy((char*)record + sizeof(RecordHeader), data, data_len);
+    record->size.store(size, memory_order_release);
+}
@@ -0,0 +1,52 @@
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <atomic>
+#include <cstdint>
+
+/* traffic recorder (--record path): inbound lines of every session are appended
+ * to one mmap'd file shared by all session processes, tools/ras_replay drives
+ * them back into a server. records are reserved by moving tail atomically and
+ * committed by storing size last, so writers never lock or call write(2). */
+const char RECORDER_MAGIC[8] = {'R', 'A', 'S', 'R', 'E', 'C', '0', '1'};
+const uint64_t RECORDER_CAPACITY = 256ull << 20; /* sparse file, records past it are dropped */
+const uint64_t RECORDER_DATA_OFFSET = 64;        /* first record, after RecorderFileHeader */
+const uint32_t RECORDER_ALIGN = 8;
+
+enum RecordKind{
+    RECORD_OPEN = 1,  /* session connected, no data */
+    RECORD_LINE = 2,  /* one command line without '\n' */
+    RECORD_PIECE = 3, /* head of a long line run before its '\n' arrived, next LINE completes it */
+    RECORD_CLOSE = 4, /* session ended, no data */
+};
+
+struct RecordHeader{
+    std::atomic<uint32_t> size; /* whole record with padding, 0 until the record is complete */
+    uint16_t kind;
+    uint16_t reserved;
+    uint32_t session_id;
+    uint32_t data_len;
+    uint64_t timestamp_ns;      /* CLOCK_REALTIME, comparable across server upgrades */
+};
+
+struct RecorderFileHeader{
+    char magic[8];
+    uint64_t capacity;                      /* file size */
+    std::atomic<uint64_t> tail;             /* offset of next record */
+    std::atomic<uint64_t> dropped;          /* records not written, file full */
+    std::atomic<uint32_t> next_session_id;
+};
+
+/* server side */
+void recorder_open(const char* path);
+bool recorder_enabled();
+
+/* session side */
+void recorder_session_start();
+void recorder_append(RecordKind kind, const char* data, uint32_t data_len);
+
+/* recorder sub functions */
+uint32_t record_size(uint32_t data_len);
+uint64_t realtime_ns();
+
+#endif
@@ -1,44 +1,116 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
 
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #include "server_arch.h"
+#include "admission.h"
+#include "session_registry.h"
+#include "placement.h"
+#include "tunables.h"
+#include "session_root.h"
 
-void start_multiprocess_server(socketfd_t listen_socket, OneConnectionService service_function){
+using namespace std;
+
+volatile sig_atomic_t server_upgrade_requested = 0;
+volatile sig_atomic_t server_reload_requested = 0;
+static volatile sig_atomic_t sessions_reaped = 0; /* by the SIGCHLD handler, their roots are swept */
+
+int start_multiprocess_server(const vector<socketfd_t>& listen_sockets, OneConnectionService service_function){
     /* wait at receive SIGCHLD, release child resource for multiprocess && concurrent server */
     signal(SIGCHLD, sigchid_waitfor_child);
+    /* no SA_RESTART, SIGUSR2 and SIGHUP must break the blocking poll */
+    catch_upgrade_signal(0);
+    catch_reload_signal(0);
+    /* children of a previous image may have exited before the handler was set */
+    sigchid_waitfor_child(SIGCHLD);
+    /* a client gone between poll and accept must not block the other listeners */
+    set_listen_nonblock(listen_sockets, true);
 
     while(1){
         socketfd_t connection_socket;
         char client_ip[IP_MAX_LEN] = {'\0'};
         int client_port;
 
-        connection_socket = socket_accept(listen_socket, client_ip, &client_port);
+        if( server_upgrade_requested ){
+            set_listen_nonblock(listen_sockets, false);
+            return SERVER_UPGRADE;
+        }
+        reload_if_requested(listen_sockets);
+        if( sessions_reaped ){
+            sessions_reaped = 0;
+            session_root_sweep();
+        }
+
+        socketfd_t accepted_from;
+        connection_socket = poll_accept(listen_sockets, NULL, client_ip, &client_port, &accepted_from);
         if( connection_socket < 0 ){
-            perror("accept error");
+            if( errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK ) perror("accept error");
             continue;
         }
 
+        int session_slot = admission_accept_connection(accepted_from, connection_socket);
+        if( session_slot < 0 ){
+            /* server is busy, client was told to come back later */
+            close(connection_socket);
+            continue;
+        }
+
+        /* a session exiting at once must not be reaped before its pid is in
+         * the slot, the handler would free the slot and the store claim it again */
+        sigset_t sigchld_mask, old_mask;
+        sigemptyset(&sigchld_mask);
+        sigaddset(&sigchld_mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &sigchld_mask, &old_mask);
         int child_pid = fork();
         if( child_pid == 0 ){
-            int ret = close(listen_socket);
-            if( ret < 0 ) perror("close listen_socket error");
+            /* command children are waited by the session itself */
+            signal(SIGCHLD, SIG_DFL);
+            signal(SIGHUP, SIG_DFL);
+            /* the handler breaks blocking reads, a session must outlive an upgrade */
+            signal(SIGUSR2, SIG_IGN);
+            /* a client gone in the middle of output is EPIPE, the session ends
+             * through its exit path and removes its root */
+            signal(SIGPIPE, SIG_IGN);
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            int ret;
+            for( socketfd_t listen_socket : listen_sockets ){
+                ret = close(listen_socket);
+                if( ret < 0 ) perror("close listen_socket error");
+            }
+
+            admission_session_start(session_slot);
+            session_registry_start(client_ip, client_port);
+            /* slots are reused, live sessions stay spread over the cpus */
+            placement_apply(session_slot);
 
             service_function(connection_socket);
+            session_registry_end();
 
             ret = close(connection_socket);
             if( ret < 0 ) perror("close connection_socket error");
             exit(EXIT_SUCCESS);
         }
         else if( child_pid > 0 ){
+            admission_session_forked(session_slot, child_pid);
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
             close(connection_socket);
         }
         else {
             perror("fork error");
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            admission_session_forked(session_slot, 0); /* give the slot back */
         }
     }
 }
@@ -47,6 +119,228 @@ void start_multiprocess_server(socketfd_t listen_socket, OneConnectionService se
 void sigchid_waitfor_child(int sig){ 
     int status;
     pid_t child;
-    while( (child = waitpid(-1, &status, WNOHANG)) > 0 );
+    while( (child = waitpid(-1, &status, WNOHANG)) > 0 ){
+        admission_session_exited(child);
+        session_registry_exited(child);
+        sessions_reaped = 1;
+    }
+}
+
+void catch_upgrade_signal(int sa_flags){
+    struct sigaction action;
+    action.sa_handler = sigusr2_request_upgrade;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = sa_flags;
+    sigaction(SIGUSR2, &action, NULL);
+}
+
+void sigusr2_request_upgrade(int sig){
+    server_upgrade_requested = 1;
+}
+
+void catch_reload_signal(int sa_flags){
+    struct sigaction action;
+    action.sa_handler = sighup_request_reload;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = sa_flags;
+    sigaction(SIGHUP, &action, NULL);
+}
+
+void sighup_request_reload(int sig){
+    server_reload_requested = 1;
+}
+
+void reload_if_requested(const vector<socketfd_t>& listen_sockets){
+    /* between sessions only, a session keeps the tunables it started with */
+    if( !server_reload_requested )
+        return;
+    server_reload_requested = 0;
+    if( tunables_reload() < 0 )
+        return;
+    for( socketfd_t listen_socket : listen_sockets )
+        tunables_apply_listen(listen_socket);
+}
+
+void set_listen_nonblock(const vector<socketfd_t>& listen_sockets, bool nonblock){
+    /* accepted sockets do not inherit O_NONBLOCK, sessions stay blocking */
+    for( socketfd_t listen_socket : listen_sockets ){
+        int flags = fcntl(listen_socket, F_GETFL);
+        fcntl(listen_socket, F_SETFL, nonblock ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+    }
+}
+
+socketfd_t poll_accept(const vector<socketfd_t>& listen_sockets, const sigset_t* wait_mask,
+  char* client_ip, int* client_port, socketfd_t* accepted_from){
+    /* wait for any listener, wait_mask as in ppoll. listeners are nonblocking,
+     * -1 with EAGAIN if another process took the connection. the search starts
+     * after the last listener accepted, a busy one does not starve the others */
+    static size_t next_listener = 0;
+    vector<struct pollfd> listen_polls;
+    for( socketfd_t listen_socket : listen_sockets )
+        listen_polls.push_back(pollfd{listen_socket, POLLIN, 0});
+    if( ppoll(listen_polls.data(), listen_polls.size(), NULL, wait_mask) < 0 )
+        return -1;
+
+    for( size_t i=0; i<listen_polls.size(); i++ ){
+        size_t index = (next_listener + i) % listen_polls.size();
+        if( !(listen_polls[index].revents & POLLIN) )
+            continue;
+        next_listener = index + 1;
+        *accepted_from = listen_sockets[index];
+        return socket_accept(listen_sockets[index], client_ip, client_port);
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+int start_preforked_server(const vector<socketfd_t>& listen_sockets, OneConnectionService service_function,
+  int worker_count){
+    /* worker_count processes accept and serve sessions one after another,
+     * master only replaces exited workers. */
+    sigset_t sigchld_mask, old_mask;
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    sigaddset(&sigchld_mask, SIGUSR2);
+    sigaddset(&sigchld_mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &sigchld_mask, &old_mask);
+    signal(SIGCHLD, sigchld_wakeup);
+    catch_upgrade_signal(0);
+    catch_reload_signal(0);
+
+    /* workers wait in poll, the one losing the race must not sleep in accept */
+    set_listen_nonblock(listen_sockets, true);
+
+    /* exited children are reaped here, not in the handler: sessions left by
+     * the previous image are children too and must not count as workers */
+    /* a replacement worker takes the index, and the cpus, of the one it replaces */
+    vector<pid_t> workers(worker_count, 0);
+    while(1){
+        int status;
+        pid_t child;
+        bool reaped = false;
+        while( (child = waitpid(-1, &status, WNOHANG)) > 0 ){
+            admission_session_exited(child);
+            session_registry_exited(child);
+            auto it = find(workers.begin(), workers.end(), child);
+            if( it != workers.end() )
+                *it = 0;
+            reaped = true;
+        }
+        if( reaped )
+            session_root_sweep();
+
+        if( server_reload_requested ){
+            /* new workers start with the new values, running ones reload after their session */
+            reload_if_requested(listen_sockets);
+            for( pid_t worker : workers ){
+                if( worker != 0 )
+                    kill(worker, SIGHUP);
+            }
+        }
+
+        for( int worker_index=0; worker_index<worker_count && !server_upgrade_requested; worker_index++ ){
+            if( workers[worker_index] != 0 )
+                continue;
+            int worker_pid = fork();
+            if( worker_pid == 0 ){
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                placement_apply(worker_index);
+                run_preforked_worker(listen_sockets, service_function);
+            }
+            else if( worker_pid > 0 ){
+                workers[worker_index] = worker_pid;
+            }
+            else{
+                perror("fork worker error");
+                break;
+            }
+        }
+
+        if( server_upgrade_requested ){
+            /* idle workers leave now, busy ones after their session */
+            for( pid_t worker : workers ){
+                if( worker != 0 )
+                    kill(worker, SIGUSR2);
+            }
+            set_listen_nonblock(listen_sockets, false);
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            return SERVER_UPGRADE;
+        }
+
+        /* SIGCHLD, SIGUSR2 and SIGHUP only delivered here, no lost wakeup */
+        sigsuspend(&old_mask);
+    }
+}
+
+/* start_preforked_server sub functions */
+void sigchld_wakeup(int sig){
+    /* only interrupts sigsuspend */
 }
 
+void run_preforked_worker(const vector<socketfd_t>& listen_sockets, OneConnectionService service_function){
+    signal(SIGCHLD, SIG_DFL);
+    /* SIGUSR2 from master: stop accepting, but a running session must not see EINTR */
+    server_upgrade_requested = 0;
+    server_reload_requested = 0;
+    catch_upgrade_signal(SA_RESTART);
+    catch_reload_signal(SA_RESTART);
+#ifdef __linux__
+    /* stop accepting when master is gone, nobody would replace this worker */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    /* as in a session process */
+    signal(SIGPIPE, SIG_IGN);
+
+    for( int served=0; served<PREFORK_SESSIONS_PER_WORKER; served++ ){
+        char client_ip[IP_MAX_LEN] = {'\0'};
+        int client_port;
+        socketfd_t accepted_from;
+        socketfd_t connection_socket = worker_accept(listen_sockets, client_ip, &client_port, &accepted_from);
+        if( connection_socket < 0 ){
+            if( server_upgrade_requested )
+                break;
+            perror("accept error");
+            continue;
+        }
+
+        int session_slot = admission_accept_connection(accepted_from, connection_socket);
+        if( session_slot < 0 ){
+            close(connection_socket);
+            continue;
+        }
+
+        admission_session_start(session_slot);
+        session_registry_start(client_ip, client_port);
+        service_function(connection_socket);
+        session_registry_end();
+        admission_session_end();
+
+        int ret = close(connection_socket);
+        if( ret < 0 ) perror("close connection_socket error");
+    }
+    exit(EXIT_SUCCESS);
+}
+
+socketfd_t worker_accept(const vector<socketfd_t>& listen_sockets, char* client_ip, int* client_port,
+  socketfd_t* accepted_from){
+    /* SIGUSR2 and SIGHUP are only let in while waiting in ppoll, no lost wakeup.
+     * listen sockets belong to the master, worker only reloads the values */
+    sigset_t usr2_mask, wait_mask;
+    sigemptyset(&usr2_mask);
+    sigaddset(&usr2_mask, SIGUSR2);
+    sigaddset(&usr2_mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &usr2_mask, &wait_mask);
+
+    socketfd_t connection_socket = -1;
+    while( !server_upgrade_requested ){
+        reload_if_requested(vector<socketfd_t>());
+        connection_socket = poll_accept(listen_sockets, &wait_mask, client_ip, client_port, accepted_from);
+        if( connection_socket >= 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) )
+            break;
+    }
+
+    int saved_errno = errno;
+    sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+    errno = saved_errno;
+    return connection_socket;
+}
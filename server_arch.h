@@ -1,13 +1,43 @@
 #ifndef __SERVER_ARCH_H__
 #define __SERVER_ARCH_H__
 
+#include <vector>
+
+#include <signal.h>
+
 #include "socket.h"
+using namespace std;
 typedef void (*OneConnectionService)(socketfd_t connection_socket); 
     /* for example, telnet_service, http_service */
 
-void start_multiprocess_server(socketfd_t listen_socket, OneConnectionService service_function);
+/* both return SERVER_UPGRADE after SIGUSR2, caller execs the new binary with listen_sockets.
+ * running sessions are not touched, they finish in the old image.
+ * every listener (TCP port, unix sockets) is served the same way, the ready one is accepted. */
+const int SERVER_UPGRADE = 1;
+extern volatile sig_atomic_t server_upgrade_requested;
+/* SIGHUP reloads tunables between sessions, master passes it to workers */
+extern volatile sig_atomic_t server_reload_requested;
+int start_multiprocess_server(const vector<socketfd_t>& listen_sockets, OneConnectionService service_function);
+int start_preforked_server(const vector<socketfd_t>& listen_sockets, OneConnectionService service_function,
+  int worker_count);
+
+const int PREFORK_SESSIONS_PER_WORKER = 1000; /* worker is replaced after this, bounds its memory */
 
 /* start_multiprocess_server sub functions */
 void sigchid_waitfor_child(int sig);
+void catch_upgrade_signal(int sa_flags);
+void sigusr2_request_upgrade(int sig);
+void catch_reload_signal(int sa_flags);
+void sighup_request_reload(int sig);
+void reload_if_requested(const vector<socketfd_t>& listen_sockets);
+void set_listen_nonblock(const vector<socketfd_t>& listen_sockets, bool nonblock);
+socketfd_t poll_accept(const vector<socketfd_t>& listen_sockets, const sigset_t* wait_mask,
+  char* client_ip, int* client_port, socketfd_t* accepted_from);
+
+/* start_preforked_server sub functions */
+void sigchld_wakeup(int sig);
+void run_preforked_worker(const vector<socketfd_t>& listen_sockets, OneConnectionService service_function);
+socketfd_t worker_accept(const vector<socketfd_t>& listen_sockets, char* client_ip, int* client_port,
+  socketfd_t* accepted_from);
 
 #endif
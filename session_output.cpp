@@ -0,0 +1,399 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "session_output.h"
+#include "io_wrapper.h"
+#include "protocol.h"
+
+using namespace std;
+
+SessionOutput::SessionOutput(int fd){
+    this->fd = fd;
+    compress = false;
+    framed = false;
+    frame_seq = 0;
+    memset(&zstream, 0, sizeof(zstream));
+    raw_bytes = 0;
+    wire_bytes = 0;
+    output_syscalls = 0;
+    splice_enabled = true;
+    struct stat fd_stat;
+    is_socket = (fstat(fd, &fd_stat) == 0 && S_ISSOCK(fd_stat.st_mode));
+    fd_flags = fcntl(fd, F_GETFL);
+    if( is_socket && fd_flags != -1 )
+        /* splice would block in kernel otherwise, unseen by stall metrics */
+        fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK);
+    pending_offset = 0;
+    stall_count = 0;
+    stalled_ms = 0;
+    peak_pending = 0;
+    forward_chunk = SESSION_OUTPUT_FORWARD_CHUNK;
+}
+
+SessionOutput::~SessionOutput(){
+    if( compress )
+        deflateEnd(&zstream);
+    if( is_socket && fd_flags != -1 )
+        fcntl(fd, F_SETFL, fd_flags);
+}
+
+int SessionOutput::write(const void* buf, size_t size){
+    if( framed ){
+        if( size == 0 )
+            return 0;
+        return write_frame(FRAME_OUTPUT, 0, buf, size);
+    }
+    return write_raw(buf, size);
+}
+
+int SessionOutput::flush(){
+    /* flush point, client can decode everything written so far */
+    if( !compress )
+        return 0;
+    return deflate_and_write(NULL, 0, Z_SYNC_FLUSH);
+}
+
+long SessionOutput::forward_from_pipe(int pipe_fd, long size){
+    /* forward size bytes from pipe, in kernel with splice(2) when output is plain.
+     * return forwarded size, -1 for error. */
+    long forwarded_size = 0;
+    if( framed ){
+        /* size is known, one frame header and the pipe data still goes by splice */
+        char header[FRAME_HEADER_SIZE];
+        frame_put_header(header, size, FRAME_OUTPUT, 0);
+        if( write_raw(header, FRAME_HEADER_SIZE) < 0 )
+            return -1;
+    }
+    if( !compress && splice_enabled && pending_bytes() == 0 ){
+        forwarded_size = splice_from_pipe(pipe_fd, size);
+        if( forwarded_size < 0 )
+            return -1;
+    }
+
+    while( forwarded_size < size ){
+        forward_buf.resize(forward_chunk);
+        char* read_buf = forward_buf.data();
+        long want_size = size - forwarded_size;
+        int read_size = read(pipe_fd, read_buf, want_size < forward_chunk ? want_size : forward_chunk);
+        output_syscalls += 1;
+        if( read_size <= 0 )
+            return -1;
+        if( write_raw(read_buf, read_size) < 0 )
+            return -1;
+        forwarded_size += read_size;
+    }
+    return forwarded_size;
+}
+
+long SessionOutput::forward_from_file(int file_fd, long size){
+    /* forward the first size bytes of a file, in kernel with sendfile(2) when output
+     * is plain. file offset is left at the end. return forwarded size, -1 for error. */
+    if( lseek(file_fd, 0, SEEK_SET) < 0 )
+        return -1;
+    long forwarded_size = 0;
+    if( framed ){
+        char header[FRAME_HEADER_SIZE];
+        frame_put_header(header, size, FRAME_OUTPUT, 0);
+        if( write_raw(header, FRAME_HEADER_SIZE) < 0 )
+            return -1;
+    }
+    if( !compress && pending_bytes() == 0 ){
+        forwarded_size = sendfile_from_file(file_fd, size);
+        if( forwarded_size < 0 )
+            return -1;
+    }
+
+    while( forwarded_size < size ){
+        forward_buf.resize(forward_chunk);
+        char* read_buf = forward_buf.data();
+        long want_size = size - forwarded_size;
+        int read_size = read(file_fd, read_buf, want_size < forward_chunk ? want_size : forward_chunk);
+        output_syscalls += 1;
+        if( read_size <= 0 )
+            return -1;
+        if( write_raw(read_buf, read_size) < 0 )
+            return -1;
+        forwarded_size += read_size;
+    }
+    return forwarded_size;
+}
+
+int SessionOutput::set_compression(const char* method){
+    /* "zlib" starts a deflate stream, "none" ends it.
+     * return -1 for unknown method or zlib error, the stream is left as it was. */
+    if( strcmp(method, "zlib") != 0 && strcmp(method, "none") != 0 )
+        return -1;
+    bool want_compress = (strcmp(method, "zlib") == 0);
+    if( want_compress == compress )
+        return 0;
+
+    if( want_compress ){
+        if( deflateInit(&zstream, Z_DEFAULT_COMPRESSION) != Z_OK )
+            return -1;
+        compress = true;
+    }
+    else{
+        /* finish the stream, client goes back to plain text after Z_STREAM_END */
+        deflate_and_write(NULL, 0, Z_FINISH);
+        deflateEnd(&zstream);
+        compress = false;
+    }
+    return 0;
+}
+
+int SessionOutput::set_protocol(const char* protocol){
+    /* "framed" or "text", return -1 for unknown protocol */
+    if( strcmp(protocol, "framed") == 0 ){
+        if( !framed )
+            frame_seq = 0;
+        framed = true;
+    }
+    else if( strcmp(protocol, "text") == 0 ){
+        framed = false;
+    }
+    else{
+        return -1;
+    }
+    return 0;
+}
+
+int SessionOutput::write_frame(int type, int flags, const void* buf, size_t size){
+    /* one frame of protocol.h, sent whatever the protocol is */
+    char header[FRAME_HEADER_SIZE];
+    frame_put_header(header, size, type, flags);
+    if( type == FRAME_STATUS )
+        frame_seq += 1;
+    if( write_raw(header, FRAME_HEADER_SIZE) < 0 )
+        return -1;
+    if( size > 0 && write_raw(buf, size) < 0 )
+        return -1;
+    return size;
+}
+
+int SessionOutput::drain(){
+    /* block until everything pending is on the wire */
+    while( pending_bytes() > 0 ){
+        if( wait_writable() < 0 || drain_pending() < 0 )
+            return -1;
+    }
+    return 0;
+}
+
+int SessionOutput::drain_until_readable(int in_fd){
+    /* send pending output while waiting for the next command on in_fd,
+     * a client pipelining commands does not wait for its output first.
+     * socket is nonblocking, so read only after this returns 0. */
+    if( !is_socket )
+        return 0;
+    while(1){
+        bool has_pending = (pending_bytes() > 0);
+        struct pollfd poll_fds[2] = {{in_fd, POLLIN, 0}, {fd, (short)(has_pending ? POLLOUT : 0), 0}};
+        int ret = poll(poll_fds, 2, has_pending ? SESSION_OUTPUT_STALL_TIMEOUT_MS : -1);
+        if( ret < 0 ){
+            if( errno == EINTR ) continue;
+            return -1;
+        }
+        if( ret == 0 ){
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if( poll_fds[1].revents && drain_pending() < 0 )
+            return -1;
+        if( poll_fds[0].revents )
+            return 0;
+    }
+}
+
+size_t SessionOutput::pending_bytes() const{
+    return pending.size() - pending_offset;
+}
+
+void SessionOutput::print_stats() const{
+    error_print("output: %ld bytes, %ld bytes on wire, %ld output syscalls\n",
+      raw_bytes, wire_bytes, output_syscalls);
+    error_print("output stalls: %ld, %.3f ms stalled, peak pending %zu bytes\n",
+      stall_count, stalled_ms, peak_pending);
+}
+
+int SessionOutput::write_raw(const void* buf, size_t size){
+    raw_bytes += size;
+    if( !compress )
+        return write_to_fd(buf, size);
+    return deflate_and_write(buf, size, Z_NO_FLUSH);
+}
+
+int SessionOutput::deflate_and_write(const void* buf, size_t size, int flush_mode){
+    zstream.next_in = (Bytef*)buf;
+    zstream.avail_in = size;
+    do{
+        zstream.next_out = zbuf;
+        zstream.avail_out = SESSION_OUTPUT_ZBUF_SIZE;
+        int ret = deflate(&zstream, flush_mode);
+        if( ret == Z_STREAM_ERROR )
+            error_print_and_exit("deflate error\n");
+
+        int out_size = SESSION_OUTPUT_ZBUF_SIZE - zstream.avail_out;
+        if( out_size > 0 && write_to_fd(zbuf, out_size) < 0 )
+            return -1;
+    } while( zstream.avail_out == 0 );
+    return size;
+}
+
+int SessionOutput::write_to_fd(const void* buf, size_t size){
+    /* never blocks below the budget, the rest of buf waits in pending.
+     * return size, -1 for error or stall timeout. */
+    if( !is_socket ){
+        int ret = write_all(fd, buf, size);
+        output_syscalls += 1;
+        if( ret > 0 )
+            wire_bytes += ret;
+        return ret;
+    }
+
+    const char* cur_buf = (const char*)buf;
+    size_t sent_size = 0;
+    if( pending_bytes() > 0 && drain_pending() < 0 )
+        return -1;
+    if( pending_bytes() == 0 ){
+        int ret = send_nonblocking(cur_buf, size);
+        if( ret < 0 )
+            return -1;
+        sent_size = ret;
+    }
+
+    while( pending_bytes() + (size - sent_size) > SESSION_OUTPUT_BUDGET ){
+        /* stalled, producer is left blocked on its pipe */
+        if( wait_writable() < 0 || drain_pending() < 0 )
+            return -1;
+        if( pending_bytes() == 0 ){
+            int ret = send_nonblocking(cur_buf + sent_size, size - sent_size);
+            if( ret < 0 )
+                return -1;
+            sent_size += ret;
+        }
+    }
+
+    if( sent_size < size ){
+        if( pending_offset > 0 ){
+            pending.erase(pending.begin(), pending.begin() + pending_offset);
+            pending_offset = 0;
+        }
+        pending.insert(pending.end(), cur_buf + sent_size, cur_buf + size);
+        if( pending.size() > peak_pending )
+            peak_pending = pending.size();
+    }
+    return size;
+}
+
+long SessionOutput::splice_from_pipe(int pipe_fd, long size){
+    /* move pipe pages to fd without copying through user space.
+     * stop early if fd does not support splice, the rest goes by read/write. */
+    long moved_size = 0;
+#ifdef SPLICE_F_MOVE
+    while( moved_size < size ){
+        /* socket is nonblocking, EAGAIN when client does not keep up */
+        ssize_t ret = splice(pipe_fd, NULL, fd, NULL, size - moved_size, SPLICE_F_MOVE);
+        output_syscalls += 1;
+        if( ret < 0 ){
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN ){
+                if( wait_writable() < 0 )
+                    return -1;
+                continue;
+            }
+            if( errno == EINVAL || errno == ENOSYS ){
+                splice_enabled = false;
+                break;
+            }
+            return -1;
+        }
+        moved_size += ret;
+    }
+    raw_bytes += moved_size;
+    wire_bytes += moved_size;
+#endif
+    return moved_size;
+}
+
+long SessionOutput::sendfile_from_file(int file_fd, long size){
+    /* like splice_from_pipe for a file at its current offset, which moves along */
+    long moved_size = 0;
+    while( moved_size < size ){
+        ssize_t ret = sendfile(fd, file_fd, NULL, size - moved_size);
+        output_syscalls += 1;
+        if( ret < 0 ){
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN ){
+                if( wait_writable() < 0 )
+                    return -1;
+                continue;
+            }
+            if( errno == EINVAL || errno == ENOSYS )
+                break;
+            return -1;
+        }
+        if( ret == 0 )
+            break;
+        moved_size += ret;
+    }
+    raw_bytes += moved_size;
+    wire_bytes += moved_size;
+    return moved_size;
+}
+
+int SessionOutput::send_nonblocking(const void* buf, size_t size){
+    /* return sent size, 0 when socket buffer is full */
+    ssize_t ret = send(fd, buf, size, MSG_DONTWAIT|MSG_NOSIGNAL);
+    output_syscalls += 1;
+    if( ret < 0 ){
+        if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+            return 0;
+        return -1;
+    }
+    wire_bytes += ret;
+    return ret;
+}
+
+int SessionOutput::drain_pending(){
+    /* send as much pending as socket takes now */
+    int ret = send_nonblocking(pending.data() + pending_offset, pending_bytes());
+    if( ret < 0 )
+        return -1;
+    pending_offset += ret;
+    if( pending_offset == pending.size() ){
+        pending.clear();
+        pending_offset = 0;
+    }
+    return ret;
+}
+
+int SessionOutput::wait_writable(){
+    /* count the wait as stalled time, -1 when client did not read for the timeout */
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct pollfd out_poll = {fd, POLLOUT, 0};
+    int ret;
+    do{
+        ret = poll(&out_poll, 1, SESSION_OUTPUT_STALL_TIMEOUT_MS);
+    } while( ret < 0 && errno == EINTR );
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    stall_count += 1;
+    stalled_ms += (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    if( ret == 0 ){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,65 @@
+#ifndef __SESSION_OUTPUT_H__
+#define __SESSION_OUTPUT_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <zlib.h>
+
+/* all data from server to client goes through SessionOutput,
+ * plain or deflate stream (setenv RAS_COMPRESS zlib), text or
+ * frames of protocol.h (setenv RAS_PROTOCOL framed). */
+const int SESSION_OUTPUT_ZBUF_SIZE = 16384;
+const int SESSION_OUTPUT_FORWARD_CHUNK = 65536; /* default forward_chunk, forward_chunk tunable */
+/* output not taken by a slow client waits in pending, up to the budget.
+ * over budget the session stops draining child output until the socket is writable. */
+const size_t SESSION_OUTPUT_BUDGET = 262144;
+const int SESSION_OUTPUT_STALL_TIMEOUT_MS = 60000; /* client not reading this long is dropped */
+
+struct SessionOutput{
+    int fd;
+    bool compress;
+    bool framed;         /* write() sends FRAME_OUTPUT frames */
+    uint32_t frame_seq;  /* seq of the next FRAME_STATUS */
+    z_stream zstream;
+    unsigned char zbuf[SESSION_OUTPUT_ZBUF_SIZE];
+    long raw_bytes;     /* bytes given by server */
+    long wire_bytes;    /* bytes written to fd */
+    long output_syscalls;
+    bool splice_enabled; /* cleared when fd can not be spliced to */
+    bool is_socket;      /* only sockets are written nonblocking, stdout in batch mode blocks */
+    int fd_flags;        /* restored at the end of the session */
+    std::vector<char> pending;
+    size_t pending_offset;
+    long stall_count;
+    double stalled_ms;   /* time session waited for client to read */
+    size_t peak_pending;
+    int forward_chunk;   /* read size when output can not be spliced */
+    std::vector<char> forward_buf;
+
+    SessionOutput(int fd);
+    ~SessionOutput();
+    int write(const void* buf, size_t size);
+    int flush();
+    long forward_from_pipe(int pipe_fd, long size);
+    long forward_from_file(int file_fd, long size);
+    int set_compression(const char* method);
+    int set_protocol(const char* protocol);
+    int write_frame(int type, int flags, const void* buf, size_t size);
+    int drain();
+    int drain_until_readable(int in_fd);
+    size_t pending_bytes() const;
+    void print_stats() const;
+
+    int write_raw(const void* buf, size_t size);
+    int deflate_and_write(const void* buf, size_t size, int flush_mode);
+    int write_to_fd(const void* buf, size_t size);
+    long splice_from_pipe(int pipe_fd, long size);
+    long sendfile_from_file(int file_fd, long size);
+    int send_nonblocking(const void* buf, size_t size);
+    int drain_pending();
+    int wait_writable();
+};
+
+#endif
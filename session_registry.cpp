@@ -0,0 +1,234 @@
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "session_registry.h"
+#include "io_wrapper.h"
+
+using namespace std;
+
+static SessionRegistry* session_registry = NULL; /* NULL when there is no listener */
+static int own_slot = -1;                        /* slot of this session process */
+static int own_id = -1;                          /* kept by job runners, for "who" and messages */
+static int own_state = SESSION_STATE_PROMPT;
+
+const int REGISTRY_READ_RETRIES = 1000; /* a writer is never that slow, its slot is going away */
+
+void session_registry_init(){
+    /* shared by listener and every forked session, free list holds every slot */
+    void* mem = mmap(NULL, sizeof(SessionRegistry), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if( mem == MAP_FAILED )
+        perror_and_exit("mmap session registry error");
+
+    session_registry = new (mem) SessionRegistry;
+    for( int i=0; i<SESSION_REGISTRY_MAX; i++ ){
+        SessionSlot& slot = session_registry->slots[i];
+        slot.seq.store(0);
+        slot.pid.store(0);
+        slot.listed.store(1);
+        slot.next_free.store(i+1 < SESSION_REGISTRY_MAX ? i+1 : SESSION_REGISTRY_NONE);
+    }
+    session_registry->free_head.store(0);
+}
+
+int session_registry_start(const char* client_ip, int client_port){
+    /* return session id, -1 if every slot is taken or there is no registry */
+    if( !session_registry )
+        return -1;
+    int index = registry_claim_slot();
+    if( index < 0 )
+        return -1;
+
+    /* readers see pid before info, they drop the copy while info.pid differs */
+    SessionSlot& slot = session_registry->slots[index];
+    registry_write_begin(slot);
+    slot.info.id = index + 1;
+    slot.info.pid = getpid();
+    snprintf(slot.info.ip, sizeof(slot.info.ip), "%s", client_ip);
+    slot.info.port = client_port;
+    slot.info.state = SESSION_STATE_PROMPT;
+    slot.info.lines = 0;
+    slot.info.start_time = time(NULL);
+    registry_write_end(slot);
+    own_slot = index;
+    own_id = index + 1;
+    own_state = SESSION_STATE_PROMPT;
+    return index + 1;
+}
+
+void session_registry_end(){
+    /* pid is checked: a forked copy of the session must not give back its slot */
+    if( !session_registry || own_slot == -1 )
+        return;
+    SessionSlot& slot = session_registry->slots[own_slot];
+    if( slot.pid.load() == getpid() ){
+        registry_release_slot(slot);
+        registry_push_free(own_slot);
+    }
+    own_slot = -1;
+    own_id = -1;
+}
+
+void session_registry_set_state(int state){
+    if( state == own_state || !session_registry || own_slot == -1 )
+        return;
+    own_state = state;
+    SessionSlot& slot = session_registry->slots[own_slot];
+    registry_write_begin(slot);
+    slot.info.state = state;
+    registry_write_end(slot);
+}
+
+void session_registry_count_line(){
+    if( !session_registry || own_slot == -1 )
+        return;
+    SessionSlot& slot = session_registry->slots[own_slot];
+    registry_write_begin(slot);
+    slot.info.lines += 1;
+    registry_write_end(slot);
+}
+
+void session_registry_forget(){
+    /* forked job runner: the slot stays with the session, one writer per slot */
+    own_slot = -1;
+}
+
+int session_registry_self(){
+    return own_id;
+}
+
+bool session_registry_lookup(int id, SessionInfo& info){
+    /* false if no session has this id */
+    if( !session_registry || id < 1 || id > SESSION_REGISTRY_MAX )
+        return false;
+    SessionSlot& slot = session_registry->slots[id-1];
+    return registry_read(slot, info) && info.id == id;
+}
+
+void session_registry_list(SessionOutput& client_output){
+    /* "who": every connected session, this one is marked */
+    const char header[] = "<ID>\t<IP:port>\t<state>\t<lines>\t<indicate me>\n";
+    client_output.write(header, strlen(header));
+    if( !session_registry )
+        return;
+    for( int i=0; i<SESSION_REGISTRY_MAX; i++ ){
+        SessionInfo info;
+        if( !registry_read(session_registry->slots[i], info) )
+            continue;
+        char line[256];
+        int size = snprintf(line, sizeof(line), "%d\t%s:%d\t%s\t%ld\t%s\n", info.id, info.ip, info.port,
+          session_state_text(info.state), info.lines, (info.id == own_id) ? "<-me" : "");
+        client_output.write(line, min(size, (int)sizeof(line)-1));
+    }
+}
+
+void session_registry_exited(int pid){
+    /* session died without session_registry_end, maybe in the middle of a write */
+    if( !session_registry ) return;
+    for( int i=0; i<SESSION_REGISTRY_MAX; i++ ){
+        /* nobody else writes a slot of a dead owner */
+        SessionSlot& slot = session_registry->slots[i];
+        if( slot.pid.load() == pid ){
+            if( slot.seq.load() & 1 )
+                slot.seq.fetch_add(1);
+            registry_release_slot(slot);
+            registry_push_free(i);
+            return;
+        }
+    }
+}
+
+/* session_registry sub functions */
+int registry_claim_slot(){
+    /* return claimed index, -1 if every slot is taken */
+    int index;
+    while( (index = registry_pop_free()) >= 0 ){
+        int expected_pid = 0;
+        if( session_registry->slots[index].pid.compare_exchange_strong(expected_pid, getpid()) )
+            return index;
+        /* stale hint, the slot was claimed by a scan */
+    }
+    for( index=0; index<SESSION_REGISTRY_MAX; index++ ){
+        int expected_pid = 0;
+        if( session_registry->slots[index].pid.compare_exchange_strong(expected_pid, getpid()) )
+            return index;
+    }
+    return -1;
+}
+
+int registry_pop_free(){
+    /* Treiber stack, the tag in the upper half changes on every pop and push,
+     * a head popped and pushed back in between does not fool the CAS */
+    uint64_t head = session_registry->free_head.load();
+    while(1){
+        int index = (int)(uint32_t)head;
+        if( index == SESSION_REGISTRY_NONE )
+            return -1;
+        uint32_t next = (uint32_t)session_registry->slots[index].next_free.load();
+        uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if( session_registry->free_head.compare_exchange_weak(head, new_head) ){
+            session_registry->slots[index].listed.store(0);
+            return index;
+        }
+    }
+}
+
+void registry_push_free(int index){
+    /* a slot still listed (a hint nobody popped) is not pushed twice */
+    int expected_listed = 0;
+    if( !session_registry->slots[index].listed.compare_exchange_strong(expected_listed, 1) )
+        return;
+    uint64_t head = session_registry->free_head.load();
+    uint64_t new_head;
+    do{
+        session_registry->slots[index].next_free.store((int)(uint32_t)head);
+        new_head = (((head >> 32) + 1) << 32) | (uint32_t)index;
+    } while( !session_registry->free_head.compare_exchange_weak(head, new_head) );
+}
+
+void registry_release_slot(SessionSlot& slot){
+    /* a later claim by the same pid, a prefork worker, must not show this info */
+    registry_write_begin(slot);
+    slot.info.pid = 0;
+    registry_write_end(slot);
+    slot.pid.store(0);
+}
+
+void registry_write_begin(SessionSlot& slot){
+    /* single writer, the owning session */
+    slot.seq.store(slot.seq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void registry_write_end(SessionSlot& slot){
+    slot.seq.store(slot.seq.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+bool registry_read(SessionSlot& slot, SessionInfo& info){
+    /* consistent copy of a used slot, false for a free one */
+    for( int retry=0; retry<REGISTRY_READ_RETRIES; retry++ ){
+        if( slot.pid.load() == 0 )
+            return false;
+        unsigned begin = slot.seq.load(memory_order_acquire);
+        if( begin & 1 )
+            continue;
+        memcpy(&info, &slot.info, sizeof(info));
+        atomic_thread_fence(memory_order_acquire);
+        if( slot.seq.load(memory_order_relaxed) == begin )
+            return info.pid == slot.pid.load();
+    }
+    return false;
+}
+
+const char* session_state_text(int state){
+    if( state == SESSION_STATE_PROMPT )
+        return "prompt";
+    if( state == SESSION_STATE_RUNNING )
+        return "running";
+    return "unknown";
+}
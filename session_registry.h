@@ -0,0 +1,78 @@
+#ifndef __SESSION_REGISTRY_H__
+#define __SESSION_REGISTRY_H__
+
+#include <atomic>
+#include <cstdint>
+
+#include "socket.h"
+#include "session_output.h"
+#include "admission.h"
+
+/* shared-memory table of connected sessions, mapped before the listener forks.
+ * a session claims a slot with one CAS of its pid into the slot, so a slot is
+ * never taken without an owner the listener can free. which slot to try comes
+ * from a lock-free free list, a hint only: a process dying between pop and
+ * claim loses the hint, not the slot, and an empty list falls back to a scan.
+ * the slot index + 1 is the session id. only the owning
+ * session writes its slot, under a per-slot seqlock: readers in other sessions
+ * copy the slot and retry if the sequence moved, no lock and no IPC.
+ * the listener frees the slot of a session which died without ending. */
+const int SESSION_REGISTRY_MAX = ADMISSION_MAX_SESSIONS;
+const int SESSION_REGISTRY_NONE = -1; /* end of free list */
+
+enum SessionState{
+    SESSION_STATE_PROMPT,     /* waiting for a line */
+    SESSION_STATE_RUNNING     /* executing lines */
+};
+
+struct SessionInfo{
+    int id;
+    int pid;
+    char ip[IP_MAX_LEN];  /* "unix" for unix socket clients */
+    int port;
+    int state;            /* SessionState */
+    long lines;           /* lines executed */
+    time_t start_time;
+};
+
+struct SessionSlot{
+    std::atomic<unsigned> seq;  /* odd while the owner writes */
+    std::atomic<int> pid;       /* 0 for free slot, claimed and cleared by CAS */
+    std::atomic<int> listed;    /* 1 while on the free list, keeps it there once */
+    std::atomic<int> next_free; /* free list link */
+    SessionInfo info;
+};
+
+struct SessionRegistry{
+    std::atomic<uint64_t> free_head; /* tag << 32 | slot index, tag defeats ABA */
+    SessionSlot slots[SESSION_REGISTRY_MAX];
+};
+
+void session_registry_init();
+
+/* session side, no-ops when the registry is off (batch mode) */
+int session_registry_start(const char* client_ip, int client_port);
+void session_registry_end();
+void session_registry_set_state(int state);
+void session_registry_count_line();
+void session_registry_forget();
+int session_registry_self();
+
+/* any process */
+bool session_registry_lookup(int id, SessionInfo& info);
+void session_registry_list(SessionOutput& client_output);
+
+/* listener side, called from SIGCHLD handler, atomics only */
+void session_registry_exited(int pid);
+
+/* session_registry sub functions */
+int registry_claim_slot();
+int registry_pop_free();
+void registry_push_free(int index);
+void registry_release_slot(SessionSlot& slot);
+void registry_write_begin(SessionSlot& slot);
+void registry_write_end(SessionSlot& slot);
+bool registry_read(SessionSlot& slot, SessionInfo& info);
+const char* session_state_text(int state);
+
+#endif
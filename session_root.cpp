@@ -0,0 +1,270 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <vector>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "session_root.h"
+#include "io_wrapper.h"
+
+using namespace std;
+
+static string fixed_root;      /* --root, absolute */
+static string template_root;   /* --root-template, absolute */
+static string session_copy;    /* copy made for the running session, empty if none */
+static pid_t session_copy_owner = -1;
+static char signal_copy_path[PATH_MAX]; /* session_copy for the signal handler, empty if none */
+
+void session_root_init(const char* root, const char* root_template){
+    /* at start, paths are made absolute: sessions chdir away from where the server started */
+    if( root && root_template )
+        error_print_and_exit("--root and --root-template can not be used together\n");
+    const char* given = root ? root : root_template;
+    if( !given )
+        return;
+
+    char resolved[PATH_MAX];
+    struct stat root_stat;
+    if( !realpath(given, resolved) || stat(resolved, &root_stat) < 0 )
+        perror_and_exit("session root error");
+    if( !S_ISDIR(root_stat.st_mode) )
+        error_print_and_exit("session root %s is not a directory\n", given);
+    if( root )
+        fixed_root = resolved;
+    else
+        template_root = resolved;
+    /* a session ending in perror_and_exit still removes its copy */
+    atexit(session_root_leave);
+}
+
+void session_root_enter(){
+    /* chdir into the root of a new session, failure ends the session */
+    string root;
+    if( !template_root.empty() ){
+        session_root_leave();
+        string copy_path = session_root_base() + "/" + SESSION_ROOT_PREFIX + to_string(getpid()) + "-XXXXXX";
+        vector<char> copy_buf(copy_path.begin(), copy_path.end());
+        copy_buf.push_back('\0');
+        if( !mkdtemp(copy_buf.data()) )
+            perror_and_exit("session root error");
+        session_copy = copy_buf.data();
+        session_copy_owner = getpid();
+        snprintf(signal_copy_path, sizeof(signal_copy_path), "%s", session_copy.c_str());
+        catch_leave_signal(SIGTERM);
+        catch_leave_signal(SIGHUP);
+        if( copy_tree(template_root, session_copy) < 0 )
+            perror_and_exit("copy session root error");
+        root = session_copy;
+    }
+    else if( !fixed_root.empty() ){
+        root = fixed_root;
+    }
+    else{
+        char* home_dir = getenv("HOME");
+        if(!home_dir)
+            error_print_and_exit("Error: No HOME enviroment variable\n");
+        root = string(home_dir) + "/ras/";
+    }
+
+    int ret = chdir(root.c_str());
+    if(ret == -1)
+        perror_and_exit("chdir error");
+}
+
+void session_root_leave(){
+    /* remove the copy of the session, only the session itself does: its
+     * forked children share session_copy and may exit through atexit too */
+    if( session_copy.empty() || session_copy_owner != getpid() )
+        return;
+    signal_copy_path[0] = '\0';
+    if( chdir("/") < 0 || remove_tree(session_copy) < 0 )
+        perror("remove session root error");
+    session_copy.clear();
+    session_copy_owner = -1;
+}
+
+void session_root_sweep(){
+    /* server, after reaping: remove copies whose session died without leaving
+     * them, e.g. by SIGKILL. a copy of another live process stays */
+    if( template_root.empty() )
+        return;
+    string base = session_root_base();
+    DIR* dir = opendir(base.c_str());
+    if( !dir )
+        return;
+    vector<string> dead_copies;
+    size_t prefix_len = strlen(SESSION_ROOT_PREFIX);
+    struct dirent* entry;
+    while( (entry = readdir(dir)) != NULL ){
+        if( strncmp(entry->d_name, SESSION_ROOT_PREFIX, prefix_len) != 0 )
+            continue;
+        char* end;
+        long pid = strtol(entry->d_name + prefix_len, &end, 10);
+        if( pid <= 0 || *end != '-' )
+            continue;
+        if( kill(pid, 0) < 0 && errno == ESRCH )
+            dead_copies.push_back(base + "/" + entry->d_name);
+    }
+    closedir(dir);
+    for( const auto& copy : dead_copies ){
+        if( remove_tree(copy) < 0 )
+            perror("remove session root error");
+    }
+}
+
+/* session_root sub functions */
+string session_root_base(){
+    /* first writable one, tmpfs keeps the copies off the disk */
+    for( int i=0; SESSION_ROOT_BASES[i]; i++ ){
+        struct stat base_stat;
+        if( stat(SESSION_ROOT_BASES[i], &base_stat) == 0 && S_ISDIR(base_stat.st_mode) &&
+          access(SESSION_ROOT_BASES[i], W_OK|X_OK) == 0 )
+            return SESSION_ROOT_BASES[i];
+    }
+    return ".";
+}
+
+int copy_tree(const string& from, const string& to){
+    /* directories, regular files and symlinks below from into the existing to.
+     * files are copied, not linked: a session writing one must not change the template.
+     * return -1 with errno set for error */
+    DIR* dir = opendir(from.c_str());
+    if( !dir )
+        return -1;
+    int ret = 0;
+    struct dirent* entry;
+    while( ret == 0 && (entry = readdir(dir)) != NULL ){
+        if( strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 )
+            continue;
+        string from_path = from + "/" + entry->d_name;
+        string to_path = to + "/" + entry->d_name;
+        struct stat entry_stat;
+        if( lstat(from_path.c_str(), &entry_stat) < 0 ){
+            ret = -1;
+        }
+        else if( S_ISDIR(entry_stat.st_mode) ){
+            if( mkdir(to_path.c_str(), entry_stat.st_mode & 07777) < 0 || copy_tree(from_path, to_path) < 0 )
+                ret = -1;
+        }
+        else if( S_ISREG(entry_stat.st_mode) ){
+            ret = copy_file(from_path, to_path, entry_stat.st_mode & 07777);
+        }
+        else if( S_ISLNK(entry_stat.st_mode) ){
+            char target[PATH_MAX];
+            ssize_t target_len = readlink(from_path.c_str(), target, sizeof(target)-1);
+            if( target_len < 0 )
+                ret = -1;
+            else{
+                target[target_len] = '\0';
+                ret = symlink(target, to_path.c_str());
+            }
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+int copy_file(const string& from, const string& to, mode_t mode){
+    int from_fd = open(from.c_str(), O_RDONLY|O_CLOEXEC);
+    if( from_fd < 0 )
+        return -1;
+    int to_fd = open(to.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, mode);
+    if( to_fd < 0 ){
+        close(from_fd);
+        return -1;
+    }
+
+    int ret = 0;
+    vector<char> buf(SESSION_ROOT_COPY_BUF_SIZE);
+    ssize_t read_size;
+    while( (read_size = read(from_fd, buf.data(), buf.size())) > 0 ){
+        if( write_all(to_fd, buf.data(), read_size) < 0 ){
+            ret = -1;
+            break;
+        }
+    }
+    if( read_size < 0 || fchmod(to_fd, mode) < 0 )
+        ret = -1;
+    close(from_fd);
+    close(to_fd);
+    return ret;
+}
+
+static int remove_entry(const char* path, const struct stat* entry_stat, int type, struct FTW* ftw_buf){
+    return remove(path);
+}
+
+int remove_tree(const string& path){
+    /* depth first, symlinks are removed, not followed */
+    return nftw(path.c_str(), remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+}
+
+void catch_leave_signal(int sig){
+    /* a handler the server set (SIGHUP of a pre-forked worker) stays */
+    struct sigaction action;
+    if( sigaction(sig, NULL, &action) < 0 || action.sa_handler != SIG_DFL )
+        return;
+    action.sa_handler = session_root_signal_leave;
+    sigemptyset(&action.sa_mask);
+    sigaddset(&action.sa_mask, SIGTERM);
+    sigaddset(&action.sa_mask, SIGHUP);
+    action.sa_flags = 0;
+    sigaction(sig, &action, NULL);
+}
+
+void session_root_signal_leave(int sig){
+    /* remove the copy, then die of sig as without the handler. forked
+     * children of the session only die, the copy is not theirs */
+#ifdef SYS_getdents64
+    if( session_copy_owner == getpid() && signal_copy_path[0] != '\0' && chdir("/") == 0 )
+        remove_tree_at(AT_FDCWD, signal_copy_path);
+#endif
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+#ifdef SYS_getdents64
+struct RawDirent{
+    /* struct linux_dirent64 */
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[1];
+};
+
+int remove_tree_at(int parent_fd, const char* name){
+    /* remove_tree for a signal handler: nftw allocates, this only makes
+     * syscalls. symlinks are removed, not followed. return -1 for error */
+    int dir_fd = openat(parent_fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if( dir_fd < 0 )
+        return -1;
+    char buf[4096];
+    long size;
+    while( (size = syscall(SYS_getdents64, dir_fd, buf, sizeof(buf))) > 0 ){
+        for( long offset=0; offset<size; ){
+            RawDirent* entry = (RawDirent*)(buf + offset);
+            offset += entry->reclen;
+            if( strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0 )
+                continue;
+            /* type is DT_UNKNOWN on some file systems, unlink tells a directory */
+            if( entry->type != DT_DIR && (unlinkat(dir_fd, entry->name, 0) == 0 || errno != EISDIR) )
+                continue;
+            remove_tree_at(dir_fd, entry->name);
+        }
+    }
+    close(dir_fd);
+    return unlinkat(parent_fd, name, AT_REMOVEDIR);
+}
+#endif
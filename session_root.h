@@ -0,0 +1,34 @@
+#ifndef __SESSION_ROOT_H__
+#define __SESSION_ROOT_H__
+
+#include <string>
+
+#include <sys/types.h>
+using namespace std;
+
+/* directory a session starts in. default is $HOME/ras, --root <dir> sets one
+ * for the server, --root-template <dir> gives every session its own copy of
+ * dir, made under SESSION_ROOT_BASES (tmpfs first) and removed when the
+ * session ends. sessions of one server then never see each other's files.
+ * a copy is named after the session pid: a session killed by SIGTERM or
+ * SIGHUP removes it in the handler, the server removes it after reaping a
+ * session killed otherwise. */
+const char* const SESSION_ROOT_BASES[] = {"/dev/shm", "/tmp", NULL};
+const char SESSION_ROOT_PREFIX[] = "ras-session-";
+const int SESSION_ROOT_COPY_BUF_SIZE = 65536;
+
+void session_root_init(const char* root, const char* root_template);
+void session_root_enter();
+void session_root_leave();
+void session_root_sweep();
+
+/* session_root sub functions */
+string session_root_base();
+int copy_tree(const string& from, const string& to);
+int copy_file(const string& from, const string& to, mode_t mode);
+int remove_tree(const string& path);
+void catch_leave_signal(int sig);
+void session_root_signal_leave(int sig);
+int remove_tree_at(int parent_fd, const char* name);
+
+#endif
@@ -1,7 +1,14 @@
+#include <cstdio>
 #include <cstring>
+#include <cerrno>
+#include <climits>
+#include <string>
 
+#include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -19,16 +26,106 @@ int socket_bind(socketfd_t socketfd, const char* ip_str, int port_hbytes){
     return bind(socketfd, (struct sockaddr*)&bind_addr, sizeof(struct sockaddr_in));
 }
 
+socketfd_t socket_listen_unix(const char* path, int mode, int backlog){
+    /* AF_UNIX stream listener at path, a stale socket file left there is replaced.
+     * the absolute path is bound, it is what another server finds in /proc/net/unix.
+     * return -1 with errno set for error */
+    string bind_path = path;
+    if( path[0] != '/' ){
+        char cwd[PATH_MAX];
+        if( !getcwd(cwd, sizeof(cwd)) )
+            return -1;
+        bind_path = string(cwd) + "/" + path;
+    }
+    struct sockaddr_un bind_addr;
+    memset(&bind_addr, 0, sizeof(bind_addr));
+    bind_addr.sun_family = AF_UNIX;
+    if( bind_path.size() >= sizeof(bind_addr.sun_path) ){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(bind_addr.sun_path, bind_path.c_str());
+
+    /* stale only if nobody listens on it. no connect to find out: a running
+     * server would take the probe for a client and start a session */
+    struct stat path_stat;
+    if( lstat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode) ){
+        if( unix_path_has_listener(bind_path) != 0 ){
+            errno = EADDRINUSE;
+            return -1;
+        }
+        unlink(path);
+    }
+
+    socketfd_t socketfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if( socketfd < 0 )
+        return -1;
+    if( bind(socketfd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) < 0 ||
+      chmod(path, mode) < 0 || listen(socketfd, backlog) < 0 ){
+        int saved_errno = errno;
+        close(socketfd);
+        errno = saved_errno;
+        return -1;
+    }
+    return socketfd;
+}
+
 socketfd_t socket_accept(socketfd_t socketfd, char* client_ip_str, int* client_port){
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(struct sockaddr_in);
+    /* unix socket clients have no address, "unix" and port 0 */
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
     int connection_fd = accept(socketfd, (struct sockaddr*)&client_addr, &client_addr_len);
 
     if( connection_fd < 0 )
         /* accept error */
         return connection_fd;
 
-    strncpy(client_ip_str, inet_ntoa(client_addr.sin_addr), IP_MAX_LEN);
-    *client_port = ntohs(client_addr.sin_port);
+    if( client_addr.ss_family == AF_INET ){
+        struct sockaddr_in* client_in = (struct sockaddr_in*)&client_addr;
+        strncpy(client_ip_str, inet_ntoa(client_in->sin_addr), IP_MAX_LEN);
+        *client_port = ntohs(client_in->sin_port);
+    }
+    else{
+        strncpy(client_ip_str, "unix", IP_MAX_LEN);
+        *client_port = 0;
+    }
     return connection_fd;
 }
+
+/* socket sub functions */
+int unix_path_has_listener(const string& path){
+    /* 1 if a listening unix socket is bound to path, 0 if none, -1 if it can
+     * not be told (no /proc/net/unix): the caller then keeps the file */
+    FILE* unix_table = fopen("/proc/net/unix", "r");
+    if( !unix_table )
+        return -1;
+    int found = 0;
+    char line[PATH_MAX + 128];
+    if( !fgets(line, sizeof(line), unix_table) ){ /* header */
+        fclose(unix_table);
+        return -1;
+    }
+    while( !found && fgets(line, sizeof(line), unix_table) ){
+        /* Num RefCount Protocol Flags Type St Inode Path */
+        unsigned long flags;
+        int path_offset = 0;
+        if( sscanf(line, "%*s %*s %*s %lx %*s %*s %*s %n", &flags, &path_offset) < 1 || path_offset == 0 )
+            continue;
+        string bound = line + path_offset;
+        while( !bound.empty() && (bound.back() == '\n' || bound.back() == ' ') )
+            bound.pop_back();
+        if( (flags & UNIX_SOCKET_ACCEPTING) && bound == path )
+            found = 1;
+    }
+    fclose(unix_table);
+    return found;
+}
+
+int socket_family(socketfd_t socketfd){
+    /* AF_INET, AF_UNIX..., -1 for error */
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if( getsockname(socketfd, (struct sockaddr*)&addr, &addr_len) < 0 )
+        return -1;
+    return addr.ss_family;
+}
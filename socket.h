@@ -1,11 +1,21 @@
 #ifndef __SOCKET_H__
 #define __SOCKET_H__
 
+#include <string>
+using namespace std;
+
 typedef int socketfd_t;
 
 const int IP_MAX_LEN = 32;
+const int UNIX_SOCKET_DEFAULT_MODE = 0666; /* like a TCP port, any local user may connect */
 
 int socket_bind(socketfd_t socketfd, const char* ip_str, int port_hbytes);
+socketfd_t socket_listen_unix(const char* path, int mode, int backlog);
 socketfd_t socket_accept(socketfd_t socketfd, char* client_ip_str, int* client_port);
+int socket_family(socketfd_t socketfd);
+
+/* socket sub functions */
+const unsigned long UNIX_SOCKET_ACCEPTING = 0x10000; /* __SO_ACCEPTCON in /proc/net/unix flags */
+int unix_path_has_listener(const string& path);
 
 #endif
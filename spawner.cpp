@@ -0,0 +1,413 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "spawner.h"
+#include "placement.h"
+#include "io_wrapper.h"
+
+using namespace std;
+
+static int spawner_control_fd = -1;  /* server and sessions -> spawner, carries session channels */
+static int spawner_channel_fd = -1;  /* one session <-> spawner */
+static int spawner_sigchld_pipe[2] = {-1, -1};
+
+struct SpawnedChild{
+    int pid;
+    int channel_fd;
+};
+static vector<SpawnedChild> spawned_children;
+static vector<SpawnerReply> early_exits; /* session side, exits of children not waited yet */
+
+/* server side */
+void spawner_start(){
+    /* fork the spawner while server image is still small */
+    int control_sockets[2];
+    if( socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, control_sockets) == -1 )
+        perror_and_exit("socketpair error");
+
+    int pid = fork();
+    if( pid == 0 ){
+        close(control_sockets[0]);
+        spawner_main(control_sockets[1]);
+        exit(EXIT_SUCCESS);
+    }
+    else if( pid < 0 ){
+        perror_and_exit("fork spawner error");
+    }
+    close(control_sockets[1]);
+    spawner_control_fd = control_sockets[0];
+}
+
+bool spawner_enabled(){
+    return spawner_channel_fd != -1;
+}
+
+/* session side */
+int spawner_session_connect(){
+    /* give spawner one end of a private channel for this session */
+    if( spawner_control_fd == -1 )
+        return -1;
+
+    int channel_sockets[2];
+    if( socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, channel_sockets) == -1 )
+        return -1;
+
+    char hello = 'S';
+    int ret = send_with_fds(spawner_control_fd, &hello, 1, &channel_sockets[1], 1);
+    close(channel_sockets[1]);
+    if( ret == -1 ){
+        close(channel_sockets[0]);
+        return -1;
+    }
+    spawner_channel_fd = channel_sockets[0];
+    return 0;
+}
+
+void spawner_session_disconnect(){
+    /* forked job runner: the channel and its replies stay with the session */
+    if( spawner_channel_fd != -1 )
+        close(spawner_channel_fd);
+    spawner_channel_fd = -1;
+    early_exits.clear();
+}
+
+int spawner_spawn(char** argv, const int fds[SPAWNER_FD_COUNT]){
+    /* return pid of the child, -1 for error */
+    static char msg[SPAWNER_MAX_MSG_SIZE];
+    extern char** environ;
+
+    char cwd[4096+1];
+    if( !getcwd(cwd, 4096) )
+        return -1;
+    char* cwd_strings[] = {cwd, NULL};
+
+    int offset = 2 * sizeof(int);
+    int argc = pack_strings(msg, SPAWNER_MAX_MSG_SIZE, offset, argv);
+    int envc = pack_strings(msg, SPAWNER_MAX_MSG_SIZE, offset, environ);
+    if( argc == -1 || envc == -1 || pack_strings(msg, SPAWNER_MAX_MSG_SIZE, offset, cwd_strings) == -1 )
+        return -1;
+    memcpy(msg, &argc, sizeof(int));
+    memcpy(msg + sizeof(int), &envc, sizeof(int));
+
+    if( send_with_fds(spawner_channel_fd, msg, offset, fds, SPAWNER_FD_COUNT) == -1 )
+        return -1;
+
+    /* lines started ahead may exit before this reply comes */
+    SpawnerReply reply;
+    while( 1 ){
+        if( recv_with_fds(spawner_channel_fd, &reply, sizeof(reply), NULL, 0) != sizeof(reply) )
+            return -1;
+        if( reply.kind != SPAWNER_EXITED )
+            break;
+        early_exits.push_back(reply);
+    }
+    if( reply.kind != SPAWNER_SPAWNED ){
+        errno = reply.status;
+        return -1;
+    }
+    return reply.pid;
+}
+
+int spawner_wait(int pid, int* status){
+    /* wait exit status of pid, like waitpid(pid, status, 0).
+     * several children may run, exits of the others are kept for their wait. */
+    for( size_t i=0; i<early_exits.size(); i++ ){
+        if( early_exits[i].pid == pid ){
+            *status = early_exits[i].status;
+            early_exits.erase(early_exits.begin() + i);
+            return pid;
+        }
+    }
+    while(1){
+        SpawnerReply reply;
+        int ret = recv_with_fds(spawner_channel_fd, &reply, sizeof(reply), NULL, 0);
+        if( ret != sizeof(reply) )
+            return -1;
+        if( reply.kind != SPAWNER_EXITED )
+            continue;
+        if( reply.pid == pid ){
+            *status = reply.status;
+            return pid;
+        }
+        early_exits.push_back(reply);
+    }
+}
+
+int spawner_try_wait(int pid, int* status){
+    /* like waitpid(pid, status, WNOHANG): pid if it exited, 0 if it still runs, -1 for error */
+    for( size_t i=0; i<early_exits.size(); i++ ){
+        if( early_exits[i].pid == pid ){
+            *status = early_exits[i].status;
+            early_exits.erase(early_exits.begin() + i);
+            return pid;
+        }
+    }
+    struct pollfd channel_poll = {spawner_channel_fd, POLLIN, 0};
+    while( poll(&channel_poll, 1, 0) > 0 ){
+        SpawnerReply reply;
+        int ret = recv_with_fds(spawner_channel_fd, &reply, sizeof(reply), NULL, 0);
+        if( ret != sizeof(reply) )
+            return -1;
+        if( reply.kind != SPAWNER_EXITED )
+            continue;
+        if( reply.pid == pid ){
+            *status = reply.status;
+            return pid;
+        }
+        early_exits.push_back(reply);
+    }
+    return 0;
+}
+
+int spawner_wait_fd(){
+    /* readable when a child spawned for this session may have exited */
+    return spawner_channel_fd;
+}
+
+/* spawner process sub functions */
+void spawner_main(int control_fd){
+    /* serve session channels until server and every session are gone */
+    if( pipe2(spawner_sigchld_pipe, O_CLOEXEC|O_NONBLOCK) == -1 )
+        perror_and_exit("spawner pipe error");
+    signal(SIGCHLD, spawner_sigchld);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, SIG_IGN);
+    /* sent to every ras process on upgrade, the spawner serves the old sessions */
+    signal(SIGUSR2, SIG_IGN);
+
+    vector<int> channel_fds;
+    while( control_fd != -1 || !channel_fds.empty() ){
+        vector<struct pollfd> poll_fds;
+        struct pollfd sigchld_poll = {spawner_sigchld_pipe[0], POLLIN, 0};
+        poll_fds.push_back(sigchld_poll);
+        if( control_fd != -1 ){
+            struct pollfd control_poll = {control_fd, POLLIN, 0};
+            poll_fds.push_back(control_poll);
+        }
+        for( int channel_fd : channel_fds ){
+            struct pollfd channel_poll = {channel_fd, POLLIN, 0};
+            poll_fds.push_back(channel_poll);
+        }
+
+        if( poll(poll_fds.data(), poll_fds.size(), -1) == -1 ){
+            if( errno == EINTR ) continue;
+            perror_and_exit("spawner poll error");
+        }
+
+        for( const auto& poll_fd : poll_fds ){
+            if( !poll_fd.revents )
+                continue;
+            if( poll_fd.fd == spawner_sigchld_pipe[0] ){
+                char drain[64];
+                while( read(spawner_sigchld_pipe[0], drain, sizeof(drain)) > 0 );
+                spawner_report_exited();
+            }
+            else if( poll_fd.fd == control_fd ){
+                /* new session channel, or server is gone */
+                char hello;
+                int channel_fd = -1;
+                if( recv_with_fds(control_fd, &hello, 1, &channel_fd, 1) <= 0 ){
+                    close(control_fd);
+                    control_fd = -1;
+                }
+                else if( channel_fd != -1 ){
+                    channel_fds.push_back(channel_fd);
+                }
+            }
+            else if( !(poll_fd.revents & POLLIN) || !spawner_handle_request(poll_fd.fd) ){
+                /* session closed its channel */
+                close(poll_fd.fd);
+                for( size_t i=0; i<channel_fds.size(); i++ ){
+                    if( channel_fds[i] == poll_fd.fd ){
+                        channel_fds.erase(channel_fds.begin() + i);
+                        break;
+                    }
+                }
+                for( auto& child : spawned_children ){
+                    if( child.channel_fd == poll_fd.fd )
+                        child.channel_fd = -1;
+                }
+            }
+        }
+    }
+}
+
+void spawner_sigchld(int sig){
+    int saved_errno = errno;
+    write(spawner_sigchld_pipe[1], "c", 1);
+    errno = saved_errno;
+}
+
+bool spawner_handle_request(int channel_fd){
+    /* return false when session closed the channel */
+    static char msg[SPAWNER_MAX_MSG_SIZE];
+    int fds[SPAWNER_FD_COUNT] = {-1, -1, -1, -1};
+    int msg_size = recv_with_fds(channel_fd, msg, SPAWNER_MAX_MSG_SIZE, fds, SPAWNER_FD_COUNT);
+    if( msg_size <= 0 )
+        return false;
+
+    SpawnerReply reply = {SPAWNER_SPAWNED, 0, 0};
+    int pid = fork();
+    if( pid == 0 ){
+        spawner_exec_child(msg, msg_size, fds);
+    }
+    else if( pid > 0 ){
+        reply.pid = pid;
+        SpawnedChild child = {pid, channel_fd};
+        spawned_children.push_back(child);
+    }
+    else{
+        reply.kind = SPAWNER_FAILED;
+        reply.status = errno;
+    }
+
+    for( int i=0; i<SPAWNER_FD_COUNT; i++ ){
+        if( fds[i] != -1 )
+            close(fds[i]);
+    }
+    send(channel_fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+    return true;
+}
+
+void spawner_exec_child(char* msg, int msg_size, const int fds[SPAWNER_FD_COUNT]){
+    /* in forked child: unpack argv, env, cwd then exec */
+    extern char** environ;
+    int argc, envc;
+    memcpy(&argc, msg, sizeof(int));
+    memcpy(&envc, msg + sizeof(int), sizeof(int));
+
+    char** argv = new char* [argc+1];
+    char** envp = new char* [envc+1];
+    char* cur = msg + 2 * sizeof(int);
+    for( int i=0; i<argc; i++, cur += strlen(cur) + 1 )
+        argv[i] = cur;
+    argv[argc] = NULL;
+    for( int i=0; i<envc; i++, cur += strlen(cur) + 1 )
+        envp[i] = cur;
+    envp[envc] = NULL;
+    char* cwd = cur;
+
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    for( int i=0; i<3; i++ )
+        dup2(fds[i], i);
+    int error_fd = fds[3];
+
+    /* PATH lookup of execvp uses environ */
+    environ = envp;
+    sched_apply_env();
+    if( chdir(cwd) == 0 )
+        execvp(argv[0], argv);
+
+    char unknown_cmd[4096];
+    int u_cmd_size = snprintf(unknown_cmd, sizeof(unknown_cmd), "Unknown command: [%s].\n", argv[0]);
+    write(error_fd, unknown_cmd, u_cmd_size);
+    _exit(EXIT_FAILURE);
+}
+
+void spawner_report_exited(){
+    int status;
+    int pid;
+    while( (pid = waitpid(-1, &status, WNOHANG)) > 0 ){
+        for( size_t i=0; i<spawned_children.size(); i++ ){
+            if( spawned_children[i].pid != pid )
+                continue;
+            if( spawned_children[i].channel_fd != -1 ){
+                SpawnerReply reply = {SPAWNER_EXITED, pid, status};
+                send(spawned_children[i].channel_fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+            }
+            spawned_children.erase(spawned_children.begin() + i);
+            break;
+        }
+    }
+}
+
+/* message helpers */
+int send_with_fds(int socket_fd, const void* buf, int size, const int* fds, int fd_count){
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(buf);
+    iov.iov_len = size;
+
+    char control[CMSG_SPACE(sizeof(int) * SPAWNER_FD_COUNT)];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if( fd_count > 0 ){
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+
+    int ret;
+    do{
+        ret = sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+    } while( ret == -1 && errno == EINTR );
+    return ret;
+}
+
+int recv_with_fds(int socket_fd, void* buf, int size, int* fds, int fd_count){
+    /* received fds are close-on-exec, dup2 clears it in the child */
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = size;
+
+    char control[CMSG_SPACE(sizeof(int) * SPAWNER_FD_COUNT)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int ret;
+    do{
+        ret = recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while( ret == -1 && errno == EINTR );
+    if( ret <= 0 )
+        return ret;
+
+    for( struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg) ){
+        if( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+            continue;
+        int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* received_fds = (int*)CMSG_DATA(cmsg);
+        for( int i=0; i<received; i++ ){
+            if( i < fd_count && fds )
+                fds[i] = received_fds[i];
+            else
+                close(received_fds[i]);
+        }
+    }
+    return ret;
+}
+
+int pack_strings(char* buf, int buf_size, int& offset, char** strings){
+    /* append NULL terminated string array, return count, -1 if buf is full */
+    int count = 0;
+    for( ; strings[count]; count++ ){
+        int len = strlen(strings[count]) + 1;
+        if( offset + len > buf_size )
+            return -1;
+        memcpy(buf + offset, strings[count], len);
+        offset += len;
+    }
+    return count;
+}
@@ -0,0 +1,50 @@
+#ifndef __SPAWNER_H__
+#define __SPAWNER_H__
+
+#include <vector>
+#include <string>
+using namespace std;
+
+/* spawner: tiny process forked at server boot, before the server grows.
+ * sessions send it (argv, env, cwd) and stdin/stdout/stderr/error fds with
+ * SCM_RIGHTS, it forks from its own small image and reports pid and exit status. */
+const int SPAWNER_MAX_MSG_SIZE = 131072;
+const int SPAWNER_FD_COUNT = 4; /* stdin, stdout, stderr, fd for "Unknown command" message */
+
+enum SpawnerReplyKind{
+    SPAWNER_SPAWNED = 1,
+    SPAWNER_EXITED = 2,
+    SPAWNER_FAILED = 3,
+};
+
+struct SpawnerReply{
+    int kind;
+    int pid;
+    int status; /* wait status for SPAWNER_EXITED, errno for SPAWNER_FAILED */
+};
+
+/* server side */
+void spawner_start();
+bool spawner_enabled();
+
+/* session side */
+int spawner_session_connect();
+void spawner_session_disconnect();
+int spawner_spawn(char** argv, const int fds[SPAWNER_FD_COUNT]);
+int spawner_wait(int pid, int* status);
+int spawner_try_wait(int pid, int* status);
+int spawner_wait_fd();
+
+/* spawner process sub functions */
+void spawner_main(int control_fd);
+void spawner_sigchld(int sig);
+bool spawner_handle_request(int channel_fd);
+void spawner_exec_child(char* msg, int msg_size, const int fds[SPAWNER_FD_COUNT]);
+void spawner_report_exited();
+
+/* message helpers */
+int send_with_fds(int socket_fd, const void* buf, int size, const int* fds, int fd_count);
+int recv_with_fds(int socket_fd, void* buf, int size, int* fds, int fd_count);
+int pack_strings(char* buf, int buf_size, int& offset, char** strings);
+
+#endif
@@ -4,7 +4,7 @@
 #include <string>
 
 const char WHITESPACE[] = " \t\r\n\v\f";
-std::string lstrip(std::string str); /* strip left whitespaces */
-std::string rstrip(std::string str); /* strip right whitespaces */
-std::string strip(std::string str); /* strip left and right whitespaces */ 
+std::string lstrip(const std::string& str); /* strip left whitespaces */
+std::string rstrip(const std::string& str); /* strip right whitespaces */
+std::string strip(const std::string& str); /* strip left and right whitespaces */ 
 #endif
@@ -0,0 +1,437 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "../recorder.h"
+#include "../io_wrapper.h"
+#include "../protocol.h"
+
+using namespace std;
+
+/* replays a --record log against a running ras: one connection per recorded
+ * session, every line is sent at its recorded offset (scaled by --speed) or
+ * right after the previous reply with --fast. latency is send to next prompt.
+ * with --framed lines go as FRAME_REQUEST without waiting for replies, latency
+ * is send to its FRAME_STATUS; --fast then sends the whole session at once. */
+const char REPLAY_PROMPT[] = "% ";
+const char REPLAY_FRAMED_SWITCH[] = "setenv RAS_PROTOCOL framed\n";
+const char* const REPLAY_UNSUPPORTED_PREFIXES[] = {
+    "setenv RAS_COMPRESS", "setenv RAS_PROTOCOL", NULL /* replies no longer are what replay reads */
+};
+
+struct ReplayLine{
+    uint64_t timestamp_ns;
+    string text;
+};
+
+struct ReplaySession{
+    uint32_t session_id;
+    uint64_t open_ns;
+    string pending_pieces;
+    vector<ReplayLine> lines;
+};
+
+struct ReplayResult{
+    mutex lock;
+    vector<double> latency_us;
+    double max_lag_ms;   /* how late lines were sent against schedule */
+    long skipped_lines;
+    long failed_sessions;
+};
+
+/* sub functions */
+int load_record(const char* path, map<uint32_t, ReplaySession>& sessions, bool dump);
+void replay_session(const ReplaySession& session, const char* host, const char* port, uint64_t base_ns,
+  double speed, bool framed, struct timespec start, ReplayResult& result);
+bool is_unsupported_line(const string& text);
+void read_status_frames(int socket_fd, size_t count, vector<struct timespec>& status_times);
+int connect_server(const char* host, const char* port);
+int read_until_prompt(int socket_fd, string& reply);
+int read_frame(int socket_fd, char* header, string& payload);
+int read_full(int fd, void* buf, size_t size);
+void sleep_until(const struct timespec& start, double offset_sec);
+double elapsed_sec(const struct timespec& start);
+double percentile(const vector<double>& sorted, double p);
+
+int main(int argc, char** argv){
+    const char* record_path = NULL;
+    const char* host = "127.0.0.1";
+    const char* port = "52000";
+    double speed = 1.0;
+    bool dump = false;
+    bool framed = false;
+    int positional = 0;
+    for( int i=1; i<argc; i++ ){
+        if( strcmp(argv[i], "--fast") == 0 )
+            speed = 0;
+        else if( strcmp(argv[i], "--speed") == 0 && i+1 < argc )
+            speed = strtod(argv[++i], NULL);
+        else if( strcmp(argv[i], "--dump") == 0 )
+            dump = true;
+        else if( strcmp(argv[i], "--framed") == 0 )
+            framed = true;
+        else if( argv[i][0] != '-' && positional == 0 )
+            record_path = argv[i], positional++;
+        else if( argv[i][0] != '-' && positional == 1 )
+            host = argv[i], positional++;
+        else if( argv[i][0] != '-' && positional == 2 )
+            port = argv[i], positional++;
+        else
+            record_path = NULL, positional = 3;
+    }
+    if( !record_path || speed < 0 )
+        error_print_and_exit("usage: %s <record> [host|/unix/path] [port] [--fast | --speed X] [--framed] | --dump <record>\n", argv[0]);
+
+    map<uint32_t, ReplaySession> sessions;
+    if( load_record(record_path, sessions, dump) < 0 )
+        return 1;
+    if( dump )
+        return 0;
+
+    uint64_t base_ns = UINT64_MAX;
+    long total_lines = 0;
+    for( auto& entry : sessions ){
+        base_ns = min(base_ns, entry.second.open_ns);
+        total_lines += entry.second.lines.size();
+    }
+    error_print("replaying %zu sessions, %ld lines to %s:%s\n", sessions.size(), total_lines, host, port);
+
+    ReplayResult result;
+    result.max_lag_ms = 0;
+    result.skipped_lines = 0;
+    result.failed_sessions = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    vector<thread> threads;
+    for( auto& entry : sessions ){
+        threads.push_back(thread(replay_session, cref(entry.second), host, port, base_ns, speed, framed, start,
+          ref(result)));
+    }
+    for( auto& t : threads )
+        t.join();
+    double wall_sec = elapsed_sec(start);
+
+    vector<double>& latency = result.latency_us;
+    sort(latency.begin(), latency.end());
+    double sum = 0;
+    for( double value : latency )
+        sum += value;
+    printf("sessions %zu, failed %ld, lines %zu, skipped %ld, wall %.3f s, %.1f lines/s\n",
+      sessions.size(), result.failed_sessions, latency.size(), result.skipped_lines, wall_sec,
+      latency.size() / wall_sec);
+    if( !latency.empty() ){
+        printf("latency us: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f, mean %.1f\n",
+          percentile(latency, 0.50), percentile(latency, 0.90), percentile(latency, 0.99),
+          percentile(latency, 0.999), latency.back(), sum / latency.size());
+    }
+    if( speed > 0 )
+        printf("max schedule lag %.3f ms\n", result.max_lag_ms);
+    return result.failed_sessions > 0;
+}
+
+int load_record(const char* path, map<uint32_t, ReplaySession>& sessions, bool dump){
+    /* group committed records by session, stop at the first record still being written */
+    int fd = open(path, O_RDONLY);
+    if( fd < 0 ){
+        perror("open record error");
+        return -1;
+    }
+    struct stat file_stat;
+    fstat(fd, &file_stat);
+    if( (uint64_t)file_stat.st_size < RECORDER_DATA_OFFSET ){
+        error_print("%s is not a ras record\n", path);
+        return -1;
+    }
+    char* mem = (char*)mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if( mem == MAP_FAILED ){
+        perror("mmap record error");
+        return -1;
+    }
+    RecorderFileHeader* file = (RecorderFileHeader*)mem;
+    if( memcmp(file->magic, RECORDER_MAGIC, sizeof(RECORDER_MAGIC)) != 0 ){
+        error_print("%s is not a ras record\n", path);
+        return -1;
+    }
+
+    uint64_t end = min(file->tail.load(), (uint64_t)file_stat.st_size);
+    uint64_t offset = RECORDER_DATA_OFFSET;
+    while( offset + sizeof(RecordHeader) <= end ){
+        RecordHeader* record = (RecordHeader*)(mem + offset);
+        uint32_t size = record->size.load(memory_order_acquire);
+        if( size == 0 || offset + size > end )
+            break;
+        offset += size;
+
+        const char* data = (const char*)(record + 1);
+        if( dump ){
+            printf("%" PRIu64 " %u %u %.*s\n", record->timestamp_ns, record->session_id, record->kind,
+              (int)record->data_len, data);
+            continue;
+        }
+
+        ReplaySession& session = sessions[record->session_id];
+        session.session_id = record->session_id;
+        if( record->kind == RECORD_OPEN ){
+            session.open_ns = record->timestamp_ns;
+        }
+        else if( record->kind == RECORD_PIECE ){
+            session.pending_pieces.append(data, record->data_len);
+        }
+        else if( record->kind == RECORD_LINE ){
+            ReplayLine line;
+            line.timestamp_ns = record->timestamp_ns;
+            line.text = session.pending_pieces + string(data, record->data_len);
+            session.pending_pieces.clear();
+            session.lines.push_back(line);
+        }
+    }
+    if( offset < end )
+        error_print("record truncated at offset %" PRIu64 ", %" PRIu64 " bytes not replayed\n", offset, end - offset);
+    if( file->dropped.load() > 0 )
+        error_print("%" PRIu64 " records were dropped by a full record file\n", file->dropped.load());
+
+    /* sessions recorded before their OPEN was in this file */
+    for( auto it = sessions.begin(); it != sessions.end(); ){
+        if( it->second.open_ns == 0 && !it->second.lines.empty() )
+            it->second.open_ns = it->second.lines[0].timestamp_ns;
+        if( it->second.open_ns == 0 )
+            it = sessions.erase(it);
+        else
+            ++it;
+    }
+    munmap(mem, file_stat.st_size);
+    return 0;
+}
+
+void replay_session(const ReplaySession& session, const char* host, const char* port, uint64_t base_ns,
+  double speed, bool framed, struct timespec start, ReplayResult& result){
+    vector<double> latency_us;
+    double max_lag_ms = 0;
+    long skipped_lines = 0;
+    bool failed = false;
+
+    if( speed > 0 )
+        sleep_until(start, (session.open_ns - base_ns) / 1e9 / speed);
+    int socket_fd = connect_server(host, port);
+    string reply;
+    if( socket_fd < 0 || read_until_prompt(socket_fd, reply) <= 0 )
+        failed = true;
+
+    vector<const ReplayLine*> lines;
+    for( const auto& line : session.lines ){
+        if( is_unsupported_line(line.text) )
+            skipped_lines += 1;
+        else
+            lines.push_back(&line);
+    }
+
+    /* framed: replies are read by another thread, sending never waits for them */
+    vector<struct timespec> sent_times(lines.size()), status_times;
+    thread status_reader;
+    if( !failed && framed ){
+        char header[FRAME_HEADER_SIZE];
+        if( write_all(socket_fd, REPLAY_FRAMED_SWITCH, strlen(REPLAY_FRAMED_SWITCH)) < 0 ||
+          read_frame(socket_fd, header, reply) <= 0 || header[4] != FRAME_STATUS )
+            failed = true;
+        else
+            status_reader = thread(read_status_frames, socket_fd, lines.size(), ref(status_times));
+    }
+
+    for( size_t i=0; !failed && i<lines.size(); i++ ){
+        const ReplayLine& line = *lines[i];
+        if( speed > 0 ){
+            double offset_sec = (line.timestamp_ns - base_ns) / 1e9 / speed;
+            sleep_until(start, offset_sec);
+            max_lag_ms = max(max_lag_ms, (elapsed_sec(start) - offset_sec) * 1000);
+        }
+
+        string request;
+        if( framed ){
+            char header[FRAME_HEADER_SIZE];
+            frame_put_header(header, line.text.size(), FRAME_REQUEST, 0);
+            request = string(header, FRAME_HEADER_SIZE) + line.text;
+        }
+        else{
+            request = line.text + "\n";
+        }
+        clock_gettime(CLOCK_MONOTONIC, &sent_times[i]);
+        if( write_all(socket_fd, request.data(), request.size()) < 0 ){
+            failed = true;
+            break;
+        }
+        if( framed )
+            continue;
+
+        /* exit closes the connection instead of prompting */
+        int ret = read_until_prompt(socket_fd, reply);
+        latency_us.push_back(elapsed_sec(sent_times[i]) * 1e6);
+        if( ret <= 0 )
+            break;
+    }
+
+    if( status_reader.joinable() ){
+        if( failed )
+            shutdown(socket_fd, SHUT_RDWR);
+        status_reader.join();
+        for( size_t i=0; i<status_times.size(); i++ ){
+            const struct timespec& sent = sent_times[i];
+            const struct timespec& done = status_times[i];
+            latency_us.push_back((done.tv_sec - sent.tv_sec) * 1e6 + (done.tv_nsec - sent.tv_nsec) / 1e3);
+        }
+    }
+    if( socket_fd >= 0 )
+        close(socket_fd);
+
+    lock_guard<mutex> guard(result.lock);
+    result.latency_us.insert(result.latency_us.end(), latency_us.begin(), latency_us.end());
+    result.max_lag_ms = max(result.max_lag_ms, max_lag_ms);
+    result.skipped_lines += skipped_lines;
+    if( failed ){
+        result.failed_sessions += 1;
+        error_print("session %u failed\n", session.session_id);
+    }
+}
+
+bool is_unsupported_line(const string& text){
+    for( int i=0; REPLAY_UNSUPPORTED_PREFIXES[i]; i++ ){
+        const char* prefix = REPLAY_UNSUPPORTED_PREFIXES[i];
+        if( text.compare(0, strlen(prefix), prefix) == 0 )
+            return true;
+    }
+    return false;
+}
+
+void read_status_frames(int socket_fd, size_t count, vector<struct timespec>& status_times){
+    /* arrival time of the FRAME_STATUS of each request, in request order */
+    char header[FRAME_HEADER_SIZE];
+    string payload;
+    while( status_times.size() < count && read_frame(socket_fd, header, payload) > 0 ){
+        if( header[4] != FRAME_STATUS )
+            continue;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        status_times.push_back(now);
+    }
+}
+
+int connect_server(const char* host, const char* port){
+    /* host starting with '/' is the unix socket of ras --unix, port unused */
+    if( host[0] == '/' ){
+        struct sockaddr_un server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sun_family = AF_UNIX;
+        if( strlen(host) >= sizeof(server_addr.sun_path) )
+            return -1;
+        strcpy(server_addr.sun_path, host);
+        int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if( socket_fd >= 0 && connect(socket_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 ){
+            close(socket_fd);
+            socket_fd = -1;
+        }
+        return socket_fd;
+    }
+
+    struct addrinfo hints, *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if( getaddrinfo(host, port, &hints, &addrs) != 0 )
+        return -1;
+    int socket_fd = -1;
+    for( struct addrinfo* addr = addrs; addr; addr = addr->ai_next ){
+        socket_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if( socket_fd < 0 )
+            continue;
+        if( connect(socket_fd, addr->ai_addr, addr->ai_addrlen) == 0 )
+            break;
+        close(socket_fd);
+        socket_fd = -1;
+    }
+    freeaddrinfo(addrs);
+    return socket_fd;
+}
+
+int read_until_prompt(int socket_fd, string& reply){
+    /* 1 at prompt, 0 on close, -1 on error. reply keeps only the tail, output can be large */
+    char buf[4096];
+    reply.clear();
+    while(1){
+        ssize_t n = read(socket_fd, buf, sizeof(buf));
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            return (int)n;
+        reply.append(buf, n);
+        if( reply.size() > 2 * sizeof(buf) )
+            reply.erase(0, reply.size() - sizeof(REPLAY_PROMPT));
+        size_t prompt_len = strlen(REPLAY_PROMPT);
+        if( reply.size() >= prompt_len && reply.compare(reply.size() - prompt_len, prompt_len, REPLAY_PROMPT) == 0 )
+            return 1;
+    }
+}
+
+int read_frame(int socket_fd, char* header, string& payload){
+    /* 1 for a frame, 0 on close, -1 on error */
+    int ret = read_full(socket_fd, header, FRAME_HEADER_SIZE);
+    if( ret <= 0 )
+        return ret;
+    payload.resize(frame_get_u32(header));
+    if( payload.empty() )
+        return 1;
+    ret = read_full(socket_fd, &payload[0], payload.size());
+    return ret <= 0 ? -1 : 1;
+}
+
+int read_full(int fd, void* buf, size_t size){
+    size_t read_size = 0;
+    while( read_size < size ){
+        ssize_t n = read(fd, (char*)buf + read_size, size - read_size);
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            return (int)n;
+        read_size += n;
+    }
+    return 1;
+}
+
+void sleep_until(const struct timespec& start, double offset_sec){
+    double wait_sec = offset_sec - elapsed_sec(start);
+    if( wait_sec <= 0 )
+        return;
+    struct timespec wait;
+    wait.tv_sec = (time_t)wait_sec;
+    wait.tv_nsec = (long)((wait_sec - wait.tv_sec) * 1e9);
+    while( nanosleep(&wait, &wait) < 0 && errno == EINTR );
+}
+
+double elapsed_sec(const struct timespec& start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+double percentile(const vector<double>& sorted, double p){
+    size_t index = (size_t)(p * sorted.size());
+    return sorted[min(index, sorted.size() - 1)];
+}
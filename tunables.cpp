@@ -0,0 +1,207 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <string>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tunables.h"
+#include "io_wrapper.h"
+
+using namespace std;
+
+Tunables tunables = default_tunables();
+static string tunables_path; /* empty without --config, reload keeps defaults */
+
+struct IntTunable{
+    const char* name;
+    int Tunables::* field;
+    int min_value;
+    int max_value;
+};
+
+static const IntTunable int_tunables[] = {
+    {"port",             &Tunables::port,             1,    65535},
+    {"listen_backlog",   &Tunables::listen_backlog,   1,    65535},
+    {"max_line_size",    &Tunables::max_line_size,    8192, 64 << 20},
+    {"max_cmd_size",     &Tunables::max_cmd_size,     16,   65536},
+    {"forward_chunk",    &Tunables::forward_chunk,    512,  1 << 20},
+    {"pipe_slots",       &Tunables::pipe_slots,       1,    65536},
+    {"so_sndbuf",        &Tunables::so_sndbuf,        0,    64 << 20},
+    {"so_rcvbuf",        &Tunables::so_rcvbuf,        0,    64 << 20},
+    {"tcp_defer_accept", &Tunables::tcp_defer_accept, 0,    3600},
+    {"tcp_keepidle",     &Tunables::tcp_keepidle,     0,    32767},
+    {"tcp_keepintvl",    &Tunables::tcp_keepintvl,    0,    32767},
+    {"tcp_keepcnt",      &Tunables::tcp_keepcnt,      0,    127},
+};
+
+void tunables_init(const char* path){
+    /* at start, a bad file stops the server */
+    if( !path )
+        return;
+    tunables_path = path;
+    if( parse_tunables(path, tunables) < 0 )
+        error_print_and_exit("config %s not loaded\n", path);
+}
+
+int tunables_reload(){
+    /* SIGHUP, a bad file keeps the values in use. return -1 for error */
+    if( tunables_path.empty() )
+        return 0;
+    Tunables parsed = default_tunables();
+    if( parse_tunables(tunables_path.c_str(), parsed) < 0 ){
+        error_print("config %s not reloaded, old values kept\n", tunables_path.c_str());
+        return -1;
+    }
+    parsed.port = tunables.port; /* listener is not moved */
+    tunables = parsed;
+    error_print("config %s reloaded\n", tunables_path.c_str());
+    return 0;
+}
+
+void tunables_apply_listen(socketfd_t listen_socket){
+    /* listen again only changes the backlog of a listening socket */
+    if( listen(listen_socket, tunables.listen_backlog) < 0 )
+        perror("listen backlog error");
+    if( socket_family(listen_socket) != AF_INET )
+        return;
+#ifdef TCP_DEFER_ACCEPT
+    if( setsockopt(listen_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &tunables.tcp_defer_accept, sizeof(int)) < 0 )
+        perror("defer accept error");
+#endif
+}
+
+void tunables_apply_session(socketfd_t session_socket){
+    /* failures are reported and the session goes on with kernel defaults */
+    if( tunables.so_sndbuf > 0 &&
+      setsockopt(session_socket, SOL_SOCKET, SO_SNDBUF, &tunables.so_sndbuf, sizeof(int)) < 0 )
+        perror("set send buffer error");
+    if( tunables.so_rcvbuf > 0 &&
+      setsockopt(session_socket, SOL_SOCKET, SO_RCVBUF, &tunables.so_rcvbuf, sizeof(int)) < 0 )
+        perror("set receive buffer error");
+    if( socket_family(session_socket) != AF_INET )
+        return;
+
+    int nodelay = tunables.tcp_nodelay ? 1 : 0;
+    if( setsockopt(session_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int)) < 0 )
+        perror("set nodelay error");
+
+    if( !tunables.so_keepalive )
+        return;
+    int on = 1;
+    if( setsockopt(session_socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(int)) < 0 )
+        perror("set keepalive error");
+#ifdef TCP_KEEPIDLE
+    if( tunables.tcp_keepidle > 0 )
+        setsockopt(session_socket, IPPROTO_TCP, TCP_KEEPIDLE, &tunables.tcp_keepidle, sizeof(int));
+    if( tunables.tcp_keepintvl > 0 )
+        setsockopt(session_socket, IPPROTO_TCP, TCP_KEEPINTVL, &tunables.tcp_keepintvl, sizeof(int));
+    if( tunables.tcp_keepcnt > 0 )
+        setsockopt(session_socket, IPPROTO_TCP, TCP_KEEPCNT, &tunables.tcp_keepcnt, sizeof(int));
+#endif
+}
+
+/* tunables sub functions */
+Tunables default_tunables(){
+    Tunables defaults;
+    defaults.port = 52000;
+    defaults.listen_backlog = 128;   /* holds the connections arriving while an upgrade execs */
+    defaults.max_line_size = 65536;
+    defaults.max_cmd_size = 256;
+    defaults.forward_chunk = 65536;
+    defaults.pipe_slots = 16;
+    defaults.so_sndbuf = 0;
+    defaults.so_rcvbuf = 0;
+    defaults.tcp_nodelay = true;
+    defaults.tcp_defer_accept = 0;
+    defaults.so_keepalive = false;
+    defaults.tcp_keepidle = 0;
+    defaults.tcp_keepintvl = 0;
+    defaults.tcp_keepcnt = 0;
+    return defaults;
+}
+
+int parse_tunables(const char* path, Tunables& parsed){
+    /* every error is reported with its line, return -1 if there was any */
+    FILE* config = fopen(path, "r");
+    if( !config ){
+        perror("open config error");
+        return -1;
+    }
+
+    char line[TUNABLES_LINE_SIZE];
+    int line_no = 0;
+    int errors = 0;
+    while( fgets(line, sizeof(line), config) ){
+        line_no += 1;
+        char* comment = strchr(line, '#');
+        if( comment )
+            *comment = '\0';
+
+        char name[TUNABLES_LINE_SIZE], value[TUNABLES_LINE_SIZE], rest[TUNABLES_LINE_SIZE];
+        char* equal = strchr(line, '=');
+        if( !equal ){
+            if( sscanf(line, "%s", name) == 1 ){
+                error_print("config %s line %d: expect name = value\n", path, line_no);
+                errors += 1;
+            }
+            continue;
+        }
+        *equal = '\0';
+        if( sscanf(line, "%s %s", name, rest) != 1 || sscanf(equal+1, "%s %s", value, rest) != 1 ){
+            error_print("config %s line %d: expect name = value\n", path, line_no);
+            errors += 1;
+            continue;
+        }
+        if( set_tunable(parsed, name, value) < 0 ){
+            error_print("config %s line %d: bad %s: %s\n", path, line_no, name, value);
+            errors += 1;
+        }
+    }
+    fclose(config);
+    return errors ? -1 : 0;
+}
+
+int set_tunable(Tunables& parsed, const char* name, const char* value){
+    /* return -1 for unknown name or value out of range */
+    for( const auto& spec : int_tunables ){
+        if( strcmp(name, spec.name) == 0 )
+            return parse_int_in_range(value, spec.min_value, spec.max_value, parsed.*spec.field) ? 0 : -1;
+    }
+
+    int flag = parse_bool(value);
+    if( strcmp(name, "tcp_nodelay") == 0 && flag != -1 )
+        parsed.tcp_nodelay = flag;
+    else if( strcmp(name, "so_keepalive") == 0 && flag != -1 )
+        parsed.so_keepalive = flag;
+    else
+        return -1;
+    return 0;
+}
+
+int parse_bool(const char* value){
+    /* 1, 0, or -1 for anything else */
+    const char* true_words[] = {"1", "on", "yes", "true", NULL};
+    const char* false_words[] = {"0", "off", "no", "false", NULL};
+    for( int i=0; true_words[i]; i++ ){
+        if( strcasecmp(value, true_words[i]) == 0 )
+            return 1;
+        if( strcasecmp(value, false_words[i]) == 0 )
+            return 0;
+    }
+    return -1;
+}
+
+bool parse_int_in_range(const char* value, int min_value, int max_value, int& result){
+    char* end;
+    errno = 0;
+    long parsed = strtol(value, &end, 0);
+    if( errno || end == value || *end != '\0' || parsed < min_value || parsed > max_value )
+        return false;
+    result = (int)parsed;
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef __TUNABLES_H__
+#define __TUNABLES_H__
+
+#include "socket.h"
+
+/* runtime tunables, "name = value" lines of the --config file, '#' starts a
+ * comment. SIGHUP to the server reloads the file: sessions started later use
+ * the new values, running sessions keep theirs. port is only read at start,
+ * command line port wins. backlog and defer accept are applied to the listening
+ * socket again on reload, the other socket options to every new session socket.
+ * unix socket sessions only take the buffer sizes, the rest is TCP. */
+struct Tunables{
+    int port;
+    int listen_backlog;
+    int max_line_size;    /* input buffer of a session, longer input is "command too long" */
+    int max_cmd_size;     /* command name shown by "Unknown command" */
+    int forward_chunk;    /* read/write size when child output can not be spliced */
+    int pipe_slots;       /* numbered pipe slots a session starts with, grows on demand */
+    int so_sndbuf;        /* session socket buffers, 0 for kernel default */
+    int so_rcvbuf;
+    bool tcp_nodelay;     /* prompt is not held back waiting for the ack of output */
+    int tcp_defer_accept; /* seconds, accept only after the client sent data, 0 off */
+    bool so_keepalive;
+    int tcp_keepidle;     /* seconds, 0 for kernel default */
+    int tcp_keepintvl;
+    int tcp_keepcnt;
+};
+
+extern Tunables tunables;
+
+const int TUNABLES_LINE_SIZE = 1024;
+
+void tunables_init(const char* path);
+int tunables_reload();
+void tunables_apply_listen(socketfd_t listen_socket);
+void tunables_apply_session(socketfd_t session_socket);
+
+/* tunables sub functions */
+Tunables default_tunables();
+int parse_tunables(const char* path, Tunables& parsed);
+int set_tunable(Tunables& parsed, const char* name, const char* value);
+int parse_bool(const char* value);
+bool parse_int_in_range(const char* value, int min_value, int max_value, int& result);
+
+#endif
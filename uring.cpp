@@ -0,0 +1,548 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "uring.h"
+#include "spawner.h"
+#include "io_wrapper.h"
+#include "probes.h"
+
+using namespace std;
+
+#ifdef RAS_HAVE_URING
+static Uring session_ring = uring_closed();
+static bool uring_disabled = false;        /* --no-uring */
+static bool uring_used = false;            /* a ring was set up, stats are printed */
+static SessionOutput* ring_output = NULL;  /* fd in URING_FILE_OUTPUT */
+static char* ring_buf = NULL;              /* registered, the pipe is read into it */
+static size_t ring_buf_size = 0;
+static int ring_pipe_fd = -1;              /* line output pipe the READ is armed on */
+static int pipe_state = URING_PIPE_IDLE;
+static bool pipe_closed = false;           /* READ saw EOF, not armed again for this line */
+static bool cancel_queued = false;         /* for the READ in flight */
+static int send_size = 0;                  /* of the SEND in flight */
+static bool stage_exited = false;
+static siginfo_t wait_info;
+static bool recv_done = false;
+static int recv_result = 0;
+static int prompt_result = 0;
+static long ring_sends = 0;
+static struct __kernel_timespec stall_timeout;
+
+/* session side */
+void uring_disable(){
+    uring_disabled = true;
+}
+
+bool uring_session_start(SessionOutput& output){
+    /* set up the ring of this session. false if the kernel lacks an op or a
+     * registration fails (RLIMIT_MEMLOCK), the session goes on without it */
+    static const int used_ops[] = {IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_WRITE, IORING_OP_SEND,
+      IORING_OP_RECV, IORING_OP_LINK_TIMEOUT, IORING_OP_ASYNC_CANCEL, URING_OP_WAITID};
+    if( uring_disabled || spawner_enabled() )
+        return false;
+    if( !uring_setup(session_ring, URING_ENTRIES) )
+        return false;
+
+    /* a pinned page would be copied by every fork, children do not get the buffer at all */
+    ring_buf_size = output.forward_chunk;
+    ring_buf = (char*)mmap(NULL, ring_buf_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if( ring_buf == MAP_FAILED ){
+        ring_buf = NULL;
+        uring_close(session_ring);
+        return false;
+    }
+    madvise(ring_buf, ring_buf_size, MADV_DONTFORK);
+    int output_fd = output.fd;
+    if( !uring_probe(session_ring, used_ops, sizeof(used_ops) / sizeof(used_ops[0])) ||
+      uring_register_buffer(session_ring, ring_buf, ring_buf_size) < 0 ||
+      uring_register_files(session_ring, &output_fd, 1) < 0 ){
+        uring_session_forget();
+        return false;
+    }
+    ring_output = &output;
+    pipe_state = URING_PIPE_IDLE;
+    pipe_closed = false;
+    cancel_queued = false;
+    ring_sends = 0;
+    stall_timeout.tv_sec = SESSION_OUTPUT_STALL_TIMEOUT_MS / 1000;
+    stall_timeout.tv_nsec = (SESSION_OUTPUT_STALL_TIMEOUT_MS % 1000) * 1000000L;
+    uring_used = true;
+    return true;
+}
+
+void uring_session_end(){
+    if( !uring_enabled() )
+        return;
+    uring_stop_pipe_read();
+    uring_close(session_ring);
+    munmap(ring_buf, ring_buf_size);
+    ring_buf = NULL;
+    ring_output = NULL;
+}
+
+void uring_session_forget(){
+    /* forked job runner: the ring stays with the session, requests in flight too.
+     * the buffer was not forked, unmapping nothing is fine */
+    if( !uring_enabled() )
+        return;
+    uring_close(session_ring);
+    if( ring_buf )
+        munmap(ring_buf, ring_buf_size);
+    ring_buf = NULL;
+    ring_output = NULL;
+    uring_used = false;
+}
+
+bool uring_enabled(){
+    return session_ring.ring_fd >= 0;
+}
+
+bool uring_can_send(const SessionOutput& output){
+    /* bytes can go out by the ring: no deflate stream, nothing pending before them */
+    return uring_enabled() && &output == ring_output && !output.compress && output.pending_bytes() == 0;
+}
+
+int uring_prompt_and_read(const char* prompt, int prompt_size, char* buf, int size){
+    /* the prompt and the read of the next command in one submission, the SEND linked
+     * before the RECV. prompt may be NULL. return read size, 0 when the client closed,
+     * -1 for error */
+    if( prompt && uring_queue_send(URING_TAG_PROMPT, prompt, prompt_size, true) < 0 )
+        return -1;
+    io_uring_sqe* sqe = uring_get_sqe(session_ring);
+    if( !sqe )
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = URING_FILE_OUTPUT;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = size;
+    sqe->user_data = URING_TAG_RECV;
+
+    recv_done = false;
+    prompt_result = 0;
+    long output_size = 0;
+    while( !recv_done ){
+        if( uring_enter(session_ring, 1) < 0 || uring_reap(output_size) < 0 )
+            return -1;
+    }
+    if( prompt_result < 0 ){
+        /* only the link timeout cancels a send */
+        errno = (prompt_result == -ECANCELED) ? ETIMEDOUT : -prompt_result;
+        return -1;
+    }
+    if( recv_result < 0 ){
+        errno = -recv_result;
+        return -1;
+    }
+    return recv_result;
+}
+
+int uring_wait_stage(int pid, int* child_status, int pipe_fd, long& output_size){
+    /* like waitpid(pid, child_status, 0), forwarding the line output while the stage
+     * runs. the READ stays armed for the next stage of the line, uring_stop_pipe_read
+     * ends it. return -1 for error */
+    if( pipe_state != URING_PIPE_IDLE && pipe_fd != ring_pipe_fd ){
+        long forwarded_size = uring_stop_pipe_read();
+        if( forwarded_size < 0 )
+            return -1;
+        output_size += forwarded_size;
+    }
+    ring_pipe_fd = pipe_fd;
+    if( pipe_state == URING_PIPE_IDLE && !pipe_closed && uring_queue_pipe_read() < 0 )
+        return -1;
+
+    io_uring_sqe* sqe = uring_get_sqe(session_ring);
+    if( !sqe )
+        return -1;
+    sqe->opcode = URING_OP_WAITID;
+    sqe->fd = pid;
+    sqe->len = P_PID;
+    sqe->file_index = WEXITED;
+    sqe->addr2 = (uintptr_t)&wait_info;
+    sqe->user_data = URING_TAG_WAIT;
+
+    stage_exited = false;
+    while( !stage_exited ){
+        if( uring_enter(session_ring, 1) < 0 || uring_reap(output_size) < 0 )
+            return -1;
+        /* a short send broke the link, the READ behind it was cancelled */
+        if( !stage_exited && pipe_state == URING_PIPE_IDLE && !pipe_closed && uring_queue_pipe_read() < 0 )
+            return -1;
+    }
+    *child_status = wait_status_of(wait_info);
+    return 0;
+}
+
+long uring_stop_pipe_read(){
+    /* every stage of the line was waited: cancel the armed READ, sending what it got
+     * first. the pipe may still hold output, the caller forwards it the usual way.
+     * return forwarded size, -1 for error */
+    long output_size = 0;
+    while( pipe_state != URING_PIPE_IDLE ){
+        if( pipe_state == URING_PIPE_READING && !cancel_queued ){
+            io_uring_sqe* sqe = uring_get_sqe(session_ring);
+            if( !sqe )
+                return -1;
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = URING_TAG_READ;
+            sqe->user_data = URING_TAG_CANCEL;
+            cancel_queued = true;
+        }
+        if( uring_enter(session_ring, 1) < 0 || uring_reap(output_size) < 0 )
+            return -1;
+    }
+    pipe_closed = false;
+    return output_size;
+}
+
+void uring_print_stats(){
+    if( !uring_used )
+        return;
+    error_print("uring: %ld enters, %ld registers, %ld sends\n", session_ring.enter_calls,
+      session_ring.register_calls, ring_sends);
+}
+
+/* session sub functions */
+int uring_reap(long& output_size){
+    /* handle every completion there is. return -1 for error, errno set */
+    io_uring_cqe cqe;
+    while( uring_pop_cqe(session_ring, cqe) ){
+        int res = cqe.res;
+        switch( cqe.user_data ){
+        case URING_TAG_WAIT:
+            if( res < 0 ){
+                errno = -res;
+                return -1;
+            }
+            stage_exited = true;
+            break;
+        case URING_TAG_READ:
+            if( res > 0 ){
+                if( uring_forward_read(res, output_size) < 0 )
+                    return -1;
+            }
+            else if( res == 0 || res == -ECANCELED ){
+                pipe_state = URING_PIPE_IDLE;
+                pipe_closed = (res == 0);
+            }
+            else{
+                errno = -res;
+                return -1;
+            }
+            break;
+        case URING_TAG_SEND:
+            if( res < 0 ){
+                errno = (res == -ECANCELED) ? ETIMEDOUT : -res;
+                return -1;
+            }
+            ring_output->raw_bytes += res;
+            ring_output->wire_bytes += res;
+            if( res < send_size ){
+                /* the READ behind it is cancelled, the rest goes the usual way */
+                if( ring_output->write_raw(ring_buf + res, send_size - res) < 0 )
+                    return -1;
+            }
+            else if( pipe_state == URING_PIPE_SENDING ){
+                pipe_state = URING_PIPE_READING;
+            }
+            break;
+        case URING_TAG_PROMPT:
+            prompt_result = res;
+            if( res > 0 ){
+                ring_output->raw_bytes += res;
+                ring_output->wire_bytes += res;
+            }
+            break;
+        case URING_TAG_RECV:
+            recv_result = res;
+            recv_done = true;
+            break;
+        default:
+            /* URING_TAG_TIMEOUT, URING_TAG_CANCEL: a timeout that fired shows as the cancelled send */
+            break;
+        }
+    }
+    return 0;
+}
+
+int uring_forward_read(int read_size, long& output_size){
+    /* read_size bytes of the line output are in the forward buffer */
+    RAS_PROBE1(output__forward, read_size);
+    output_size += read_size;
+    if( !ring_output->framed && uring_can_send(*ring_output) ){
+        send_size = read_size;
+        if( uring_queue_send(URING_TAG_SEND, ring_buf, read_size, true) < 0 || uring_queue_pipe_read() < 0 )
+            return -1;
+        pipe_state = URING_PIPE_SENDING;
+        return 0;
+    }
+    if( ring_output->write(ring_buf, read_size) < 0 )
+        return -1;
+    return uring_queue_pipe_read();
+}
+
+int uring_queue_pipe_read(){
+    /* READ_FIXED of the line output pipe into the registered buffer */
+    io_uring_sqe* sqe = uring_get_sqe(session_ring);
+    if( !sqe )
+        return -1;
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = ring_pipe_fd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uintptr_t)ring_buf;
+    sqe->len = ring_buf_size;
+    sqe->buf_index = 0;
+    sqe->user_data = URING_TAG_READ;
+    pipe_state = URING_PIPE_READING;
+    cancel_queued = false;
+    return 0;
+}
+
+int uring_queue_send(int tag, const void* buf, int size, bool link_next){
+    /* SEND to the client socket, behind it a link timeout that cancels it when the
+     * client stalls. not a socket (stdout in batch mode): a write, fixed if buf is
+     * the registered buffer. link_next links what is queued next */
+    io_uring_sqe* sqe = uring_get_sqe(session_ring);
+    if( !sqe )
+        return -1;
+    sqe->fd = URING_FILE_OUTPUT;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = size;
+    sqe->user_data = tag;
+    ring_sends += 1;
+    if( !ring_output->is_socket ){
+        sqe->off = (uint64_t)-1;
+        sqe->opcode = IORING_OP_WRITE;
+        if( buf == ring_buf ){
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->buf_index = 0;
+        }
+        if( link_next )
+            sqe->flags |= IOSQE_IO_LINK;
+        return 0;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->flags |= IOSQE_IO_LINK;
+    io_uring_sqe* timeout_sqe = uring_get_sqe(session_ring);
+    if( !timeout_sqe )
+        return -1;
+    timeout_sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    timeout_sqe->addr = (uintptr_t)&stall_timeout;
+    timeout_sqe->len = 1;
+    timeout_sqe->user_data = URING_TAG_TIMEOUT;
+    if( link_next )
+        timeout_sqe->flags = IOSQE_IO_LINK;
+    return 0;
+}
+
+int wait_status_of(const siginfo_t& info){
+    /* waitid result as waitpid would report it */
+    if( info.si_code == CLD_EXITED )
+        return (info.si_status & 0xff) << 8;
+    if( info.si_code == CLD_DUMPED )
+        return info.si_status | 0x80;
+    return info.si_status;
+}
+
+/* uring sub functions */
+Uring uring_closed(){
+    /* no ring set up yet */
+    Uring ring = Uring();
+    ring.ring_fd = -1;
+    return ring;
+}
+
+bool uring_setup(Uring& ring, unsigned entries){
+    /* false without io_uring or without one mapping for both rings (linux 5.4) */
+#ifdef SYS_io_uring_setup
+    /* completions are only looked at after a wait, no need to interrupt for them:
+     * best is to run them all in that wait (linux 6.1), then to just not interrupt (5.19) */
+    const unsigned setup_flags[] = {
+#if defined(IORING_SETUP_SINGLE_ISSUER) && defined(IORING_SETUP_DEFER_TASKRUN)
+      IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_DEFER_TASKRUN,
+#endif
+#ifdef IORING_SETUP_COOP_TASKRUN
+      IORING_SETUP_COOP_TASKRUN,
+#endif
+      0};
+    struct io_uring_params params;
+    int fd = -1;
+    for( unsigned flags : setup_flags ){
+        memset(&params, 0, sizeof(params));
+        params.flags = flags;
+        fd = syscall(SYS_io_uring_setup, entries, &params);
+        if( fd >= 0 || errno != EINVAL )
+            break;
+    }
+    if( fd < 0 )
+        return false;
+    if( !(params.features & IORING_FEAT_SINGLE_MMAP) ){
+        close(fd);
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ring.ring_mem_size = max(sq_size, cq_size);
+    ring.ring_mem = mmap(NULL, ring.ring_mem_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+      IORING_OFF_SQ_RING);
+    if( ring.ring_mem == MAP_FAILED ){
+        close(fd);
+        return false;
+    }
+    ring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    ring.sqes = (io_uring_sqe*)mmap(NULL, ring.sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+      IORING_OFF_SQES);
+    if( ring.sqes == MAP_FAILED ){
+        munmap(ring.ring_mem, ring.ring_mem_size);
+        close(fd);
+        return false;
+    }
+
+    char* mem = (char*)ring.ring_mem;
+    ring.sq_head = (unsigned*)(mem + params.sq_off.head);
+    ring.sq_tail = (unsigned*)(mem + params.sq_off.tail);
+    ring.sq_mask = (unsigned*)(mem + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(mem + params.sq_off.array);
+    ring.sq_entries = params.sq_entries;
+    ring.cq_head = (unsigned*)(mem + params.cq_off.head);
+    ring.cq_tail = (unsigned*)(mem + params.cq_off.tail);
+    ring.cq_mask = (unsigned*)(mem + params.cq_off.ring_mask);
+    ring.cqes = (io_uring_cqe*)(mem + params.cq_off.cqes);
+    ring.local_tail = *ring.sq_tail;
+    ring.to_submit = 0;
+    ring.enter_calls = 0;
+    ring.register_calls = 0;
+    ring.ring_fd = fd;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void uring_close(Uring& ring){
+    munmap(ring.sqes, ring.sqes_size);
+    munmap(ring.ring_mem, ring.ring_mem_size);
+    close(ring.ring_fd);
+    ring.ring_fd = -1;
+}
+
+bool uring_probe(Uring& ring, const int* ops, int op_count){
+    /* true if the kernel has every op */
+    const int probe_op_count = 256;
+    vector<char> probe_mem(sizeof(io_uring_probe) + probe_op_count * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = (io_uring_probe*)probe_mem.data();
+    ring.register_calls += 1;
+    if( syscall(SYS_io_uring_register, ring.ring_fd, IORING_REGISTER_PROBE, probe, probe_op_count) < 0 )
+        return false;
+    for( int i=0; i<op_count; i++ ){
+        if( ops[i] >= probe->ops_len || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) )
+            return false;
+    }
+    return true;
+}
+
+io_uring_sqe* uring_get_sqe(Uring& ring){
+    /* zeroed sqe, submitted by the next uring_enter. NULL when the sq is full */
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if( ring.local_tail - head >= ring.sq_entries )
+        return NULL;
+    unsigned index = ring.local_tail & *ring.sq_mask;
+    io_uring_sqe* sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    ring.local_tail += 1;
+    ring.to_submit += 1;
+    return sqe;
+}
+
+int uring_enter(Uring& ring, unsigned wait_count){
+    /* submit what was queued, wait for wait_count completions. return -1 for error */
+    __atomic_store_n(ring.sq_tail, ring.local_tail, __ATOMIC_RELEASE);
+    while(1){
+        int ret = syscall(SYS_io_uring_enter, ring.ring_fd, ring.to_submit, wait_count,
+          wait_count > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        ring.enter_calls += 1;
+        if( ret >= 0 ){
+            /* submitted ones; a wait cut short is waited again by the caller's loop */
+            ring.to_submit -= min((unsigned)ret, ring.to_submit);
+            return 0;
+        }
+        if( errno != EINTR )
+            return -1;
+    }
+}
+
+bool uring_pop_cqe(Uring& ring, io_uring_cqe& cqe){
+    unsigned head = *ring.cq_head;
+    if( head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) )
+        return false;
+    cqe = ring.cqes[head & *ring.cq_mask];
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+int uring_register_buffer(Uring& ring, void* buf, size_t size){
+    struct iovec iov = {buf, size};
+    ring.register_calls += 1;
+    return syscall(SYS_io_uring_register, ring.ring_fd, IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+int uring_register_files(Uring& ring, const int* fds, int fd_count){
+    ring.register_calls += 1;
+    return syscall(SYS_io_uring_register, ring.ring_fd, IORING_REGISTER_FILES, fds, fd_count);
+}
+#else
+/* session side, without io_uring */
+void uring_disable(){
+}
+
+bool uring_session_start(SessionOutput&){
+    return false;
+}
+
+void uring_session_end(){
+}
+
+void uring_session_forget(){
+}
+
+bool uring_enabled(){
+    return false;
+}
+
+bool uring_can_send(const SessionOutput&){
+    return false;
+}
+
+int uring_prompt_and_read(const char*, int, char*, int){
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_wait_stage(int, int*, int, long&){
+    errno = ENOSYS;
+    return -1;
+}
+
+long uring_stop_pipe_read(){
+    return 0;
+}
+
+void uring_print_stats(){
+}
+#endif
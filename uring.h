@@ -0,0 +1,107 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <cstddef>
+#include <csignal>
+
+#include "session_output.h"
+
+/* without linux/io_uring.h (not linux, or headers older than 5.6) uring.o is
+ * built as a stub, every session keeps poll, splice and pidfd */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IO_URING_OP_SUPPORTED
+#define RAS_HAVE_URING 1
+#endif
+#endif
+#endif
+
+/* io_uring by its raw syscalls, no liburing. a session sets up its own ring
+ * when it starts, if the kernel has every op used here; otherwise, with
+ * --no-uring, or with --spawner (stages are not children of the session),
+ * it keeps poll, splice and pidfd.
+ * - while the stages of a line run, a READ_FIXED of the line output pipe into
+ *   the registered buffer is armed. a completed read is sent by a SEND
+ *   linked to the next READ: one enter per chunk, and the buffer is not read
+ *   into again before it is sent. a slow client leaves the SEND waiting and
+ *   the stage blocked on its pipe, a link timeout drops a stalled client.
+ * - a stage is reaped by IORING_OP_WAITID, submitted with the wait itself.
+ * - the prompt goes out by a SEND linked to the RECV of the next command.
+ * the session output fd is the one fixed file. */
+const unsigned URING_ENTRIES = 16;
+const int URING_FILE_OUTPUT = 0;  /* fixed file slot */
+const int URING_OP_WAITID = 50;   /* IORING_OP_WAITID of linux 6.7, older headers lack it */
+
+enum UringTag{  /* user_data of the requests */
+    URING_TAG_WAIT = 1,
+    URING_TAG_READ,
+    URING_TAG_SEND,
+    URING_TAG_TIMEOUT,
+    URING_TAG_CANCEL,
+    URING_TAG_PROMPT,
+    URING_TAG_RECV,
+};
+
+enum UringPipeState{
+    URING_PIPE_IDLE,     /* nothing armed on the line output pipe */
+    URING_PIPE_READING,  /* READ in flight */
+    URING_PIPE_SENDING,  /* SEND in flight, READ linked behind it */
+};
+
+#ifdef RAS_HAVE_URING
+struct Uring{
+    int ring_fd;
+    void* ring_mem;        /* sq and cq ring, one mapping */
+    size_t ring_mem_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    unsigned local_tail;   /* sqes written, published by uring_enter */
+    unsigned to_submit;
+    long enter_calls;
+    long register_calls;
+};
+#endif
+
+/* session side */
+void uring_disable();
+bool uring_session_start(SessionOutput& output);
+void uring_session_end();
+void uring_session_forget();
+bool uring_enabled();
+bool uring_can_send(const SessionOutput& output);
+int uring_prompt_and_read(const char* prompt, int prompt_size, char* buf, int size);
+int uring_wait_stage(int pid, int* child_status, int pipe_fd, long& output_size);
+long uring_stop_pipe_read();
+void uring_print_stats();
+
+#ifdef RAS_HAVE_URING
+/* session sub functions */
+int uring_reap(long& output_size);
+int uring_forward_read(int read_size, long& output_size);
+int uring_queue_pipe_read();
+int uring_queue_send(int tag, const void* buf, int size, bool link_next);
+int wait_status_of(const siginfo_t& info);
+
+/* uring sub functions */
+Uring uring_closed();
+bool uring_setup(Uring& ring, unsigned entries);
+void uring_close(Uring& ring);
+bool uring_probe(Uring& ring, const int* ops, int op_count);
+io_uring_sqe* uring_get_sqe(Uring& ring);
+int uring_enter(Uring& ring, unsigned wait_count);
+bool uring_pop_cqe(Uring& ring, io_uring_cqe& cqe);
+int uring_register_buffer(Uring& ring, void* buf, size_t size);
+int uring_register_files(Uring& ring, const int* fds, int fd_count);
+#endif
+
+#endif